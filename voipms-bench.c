@@ -0,0 +1,201 @@
+
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks for the request-building and response-parsing hot paths. *
+ * These all live in the core, so there's no need for libpurple here.        */
+
+#include "voipms-core.h"
+
+#include <sys/resource.h>
+
+#define BENCH_CHUNK_SIZE 16384
+#define BENCH_MIN_NS 200000000 /* Run each case for at least 0.2s. */
+
+/* Count allocations by sitting in front of glibc's allocator. */
+extern void* __libc_malloc( size_t );
+extern void* __libc_calloc( size_t, size_t );
+extern void* __libc_realloc( void*, size_t );
+
+static unsigned long bench_allocations = 0;
+
+void* malloc( size_t size ) {
+   bench_allocations++;
+   return __libc_malloc( size );
+}
+
+void* calloc( size_t nmemb, size_t size ) {
+   bench_allocations++;
+   return __libc_calloc( nmemb, size );
+}
+
+void* realloc( void* ptr, size_t size ) {
+   bench_allocations++;
+   return __libc_realloc( ptr, size );
+}
+
+typedef void (*BenchFunc)( gpointer );
+
+struct BenchPayload {
+   gchar* body;
+   size_t size;
+   GSList* args;
+   struct RequestMemoryStruct buffer;
+};
+
+static gint64 bench_now_ns( void ) {
+   struct timespec now;
+
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return (gint64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void bench_run(
+   const char* name, size_t messages, BenchFunc fn, gpointer data
+) {
+   gint64 start,
+      elapsed;
+   unsigned long iterations = 0,
+      allocations;
+
+   /* Warm up once so first-touch costs don't skew small cases. */
+   fn( data );
+
+   allocations = bench_allocations;
+   start = bench_now_ns();
+   do {
+      fn( data );
+      iterations++;
+      elapsed = bench_now_ns() - start;
+   } while( BENCH_MIN_NS > elapsed );
+   allocations = bench_allocations - allocations;
+
+   printf(
+      "%-14s %8lu %14.1f %14.1f\n",
+      name, (unsigned long)messages,
+      (double)elapsed / iterations, (double)allocations / iterations
+   );
+}
+
+static gchar* bench_make_payload( size_t count ) {
+   GString* body;
+   size_t i;
+
+   /* Shaped like a real getSMS response, newest first. */
+   body = g_string_sized_new( 64 + count * 160 );
+   g_string_append( body, "{\"status\":\"success\",\"sms\":[" );
+   for( i = 0; count > i; i++ ) {
+      g_string_append_printf(
+         body,
+         "%s{\"id\":\"%lu\",\"date\":\"2016-03-%02lu %02lu:%02lu:%02lu\","
+         "\"type\":\"1\",\"did\":\"5551234567\",\"contact\":\"555%07lu\","
+         "\"message\":\"Message %lu: caf\\u00e9 & friends ~ \\\"quoted\\\"\"}",
+         0 == i ? "" : ",",
+         (unsigned long)(count - i), (unsigned long)(1 + i % 28),
+         (unsigned long)(i % 24), (unsigned long)(i % 60),
+         (unsigned long)(i % 60), (unsigned long)(i % 10000000),
+         (unsigned long)i
+      );
+   }
+   g_string_append( body, "]}" );
+
+   return g_string_free( body, FALSE );
+}
+
+static void bench_write_body( gpointer data ) {
+   struct BenchPayload* payload = (struct BenchPayload*)data;
+   struct RequestMemoryStruct chunk = { NULL, 0, 0 };
+   size_t offset,
+      step;
+
+   /* Feed it in the kind of pieces libcurl hands us. */
+   for( offset = 0; offset < payload->size; offset += step ) {
+      step = MIN( BENCH_CHUNK_SIZE, payload->size - offset );
+      voipms_api_request_write_body_callback(
+         &(payload->body[offset]), 1, step, &chunk
+      );
+   }
+
+   free( chunk.memory );
+}
+
+static void bench_parse( gpointer data ) {
+   struct BenchPayload* payload = (struct BenchPayload*)data;
+   struct GcFuncDataMessageList message_list =
+      { NULL, NULL, FALSE, FALSE, FALSE };
+   JsonParser* parser;
+   JsonObject* response;
+
+   parser = json_parser_new();
+   response = voipms_api_parse_response(
+      parser, payload->body, payload->size
+   );
+   if( NULL != response ) {
+      voipms_api_parse_messages( response, &message_list );
+   }
+   g_list_free_full( message_list.messages, voipms_message_free );
+   g_object_unref( parser );
+}
+
+static void bench_build_form( gpointer data ) {
+   struct BenchPayload* payload = (struct BenchPayload*)data;
+
+   voipms_api_build_form( &(payload->buffer), payload->args, NULL );
+}
+
+int main( int argc, char** argv ) {
+   size_t counts[] = { 1, 10, 100, 1000, 10000, 100000 };
+   struct BenchPayload payload = { 0 };
+   struct rusage usage;
+   size_t i;
+
+   printf(
+      "%-14s %8s %14s %14s\n", "benchmark", "messages", "ns/op", "allocs/op"
+   );
+
+   /* A typical sendSMS request, credentials and all. */
+   payload.args = voipms_api_args_add( payload.args, "did", "5551234567" );
+   payload.args = voipms_api_args_add( payload.args, "dst", "5557654321" );
+   payload.args = voipms_api_args_add(
+      payload.args, "message",
+      "Running about ten minutes late ~ grab a table & order for me? "
+      "Caf\xc3\xa9 on 5th, not the one by the station. 100% sure this time!"
+   );
+   payload.args = voipms_api_args_add(
+      payload.args, "api_username", "someone@example.com"
+   );
+   payload.args =
+      voipms_api_args_add( payload.args, "api_password", "s3cr3t&p@ss" );
+   payload.args = voipms_api_args_add( payload.args, "method", "sendSMS" );
+   bench_run( "build_form", 1, bench_build_form, &payload );
+   g_slist_free_full( payload.args, voipms_api_args_free );
+   free( payload.buffer.memory );
+
+   for( i = 0; G_N_ELEMENTS( counts ) > i; i++ ) {
+      payload.body = bench_make_payload( counts[i] );
+      payload.size = strlen( payload.body );
+
+      bench_run( "write_body", counts[i], bench_write_body, &payload );
+      bench_run( "parse", counts[i], bench_parse, &payload );
+
+      g_free( payload.body );
+   }
+
+   getrusage( RUSAGE_SELF, &usage );
+   printf( "peak RSS: %ld KiB\n", usage.ru_maxrss );
+
+   return 0;
+}
+
@@ -0,0 +1,376 @@
+
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A command-line front end for the core, for scripts and for poking at the  *
+ * API without a running Pidgin.                                             */
+
+#include "voipms-core.h"
+
+#include <signal.h>
+#include <stdlib.h>
+
+#define VOIPMS_CLI_WAIT_MS 1000
+
+struct VoipMsCli {
+   gboolean delete_;
+   gboolean done;
+   int exit_status;
+   GHashTable* seen; /* IDs already printed, when not deleting. */
+};
+
+static volatile sig_atomic_t _voipms_cli_interrupted = 0;
+
+static gchar* _voipms_cli_username = NULL;
+static gchar* _voipms_cli_password = NULL;
+static gchar* _voipms_cli_did = NULL;
+static gchar* _voipms_cli_api_url = NULL;
+static gchar* _voipms_cli_relay = NULL;
+static gchar* _voipms_cli_trace = NULL;
+static gboolean _voipms_cli_get = FALSE;
+static gint _voipms_cli_budget = 0;
+static gint _voipms_cli_concurrency = VOIPMS_BULK_DEFAULT_CONCURRENCY;
+static gint _voipms_cli_rate = VOIPMS_BULK_DEFAULT_RATE;
+static gboolean _voipms_cli_mms = FALSE;
+static gboolean _voipms_cli_delete = FALSE;
+static gboolean _voipms_cli_verbose = FALSE;
+
+static GOptionEntry _voipms_cli_options[] = {
+   { "username", 'u', 0, G_OPTION_ARG_STRING, &_voipms_cli_username,
+      "VOIP.ms account e-mail address", "EMAIL" },
+   { "password", 'p', 0, G_OPTION_ARG_STRING, &_voipms_cli_password,
+      "API password (default: $VOIPMS_API_PASSWORD)", "PASSWORD" },
+   { "did", 'd', 0, G_OPTION_ARG_STRING, &_voipms_cli_did,
+      "DID to send from and receive for", "NUMBER" },
+   { "api-url", 0, 0, G_OPTION_ARG_STRING, &_voipms_cli_api_url,
+      "API URL (default: " VOIPMS_API_URL ")", "URL" },
+   { "relay", 'r', 0, G_OPTION_ARG_STRING, &_voipms_cli_relay,
+      "Go through the relay listening at PATH instead of the API", "PATH" },
+   { "budget", 'b', 0, G_OPTION_ARG_INT, &_voipms_cli_budget,
+      "Stretch the poll interval to stay under KB per hour", "KB" },
+   { "concurrency", 'c', 0, G_OPTION_ARG_INT, &_voipms_cli_concurrency,
+      "Bulk sends to have in flight at once", "N" },
+   { "rate", 0, 0, G_OPTION_ARG_INT, &_voipms_cli_rate,
+      "Bulk sends to start per second", "N" },
+   { "trace", 't', 0, G_OPTION_ARG_FILENAME, &_voipms_cli_trace,
+      "Save the flight recorder to FILE if the command fails", "FILE" },
+   { "get", 0, 0, G_OPTION_ARG_NONE, &_voipms_cli_get,
+      "Send requests as GET query strings instead of POST bodies", NULL },
+   { "mms", 'm', 0, G_OPTION_ARG_NONE, &_voipms_cli_mms,
+      "Also poll for picture messages", NULL },
+   { "delete", 0, 0, G_OPTION_ARG_NONE, &_voipms_cli_delete,
+      "Delete messages from the server once they're printed", NULL },
+   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &_voipms_cli_verbose,
+      "Log requests to stderr", NULL },
+   { NULL }
+};
+
+static void voipms_cli_interrupt( int signum ) {
+   _voipms_cli_interrupted = 1;
+}
+
+static void voipms_cli_log_handler(
+   const gchar* log_domain, GLogLevelFlags log_level, const gchar* message,
+   gpointer user_data
+) {
+   if(
+      _voipms_cli_verbose ||
+      log_level & (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL)
+   ) {
+      fprintf( stderr, "%s\n", message );
+   }
+}
+
+static void voipms_cli_print(
+   struct VoipMsSession* session, GList* messages, gboolean delete_
+) {
+   struct VoipMsCli* cli = (struct VoipMsCli*)session->user_data;
+   struct VoipMsMessage* message;
+   char date_buffer[VOIPMS_DATE_BUFFER_SIZE];
+   GSList* api_args;
+   GList* iter,
+      * media_iter;
+
+   for( iter = messages; NULL != iter; iter = g_list_next( iter ) ) {
+      message = (struct VoipMsMessage*)iter->data;
+
+      if( NULL != cli->seen ) {
+         if(
+            NULL == message->id ||
+            g_hash_table_contains( cli->seen, message->id )
+         ) {
+            continue;
+         }
+         g_hash_table_add( cli->seen, g_strdup( message->id ) );
+      }
+
+      strftime(
+         date_buffer, sizeof( date_buffer ), "%F %T", &(message->timeinfo)
+      );
+      printf(
+         "%s %s %s: %s\n",
+         date_buffer, message->outgoing ? "->" : "<-", message->contact,
+         message->message
+      );
+      for(
+         media_iter = message->media;
+         NULL != media_iter;
+         media_iter = g_list_next( media_iter )
+      ) {
+         printf( "   %s\n", (gchar*)media_iter->data );
+      }
+
+      if( delete_ && NULL != message->id ) {
+         api_args = voipms_api_args_add( NULL, "id", message->id );
+         voipms_api_request(
+            session,
+            message->mms ? VOIPMS_METHOD_DELETEMMS : VOIPMS_METHOD_DELETESMS,
+            api_args, NULL
+         );
+      }
+   }
+
+   fflush( stdout );
+}
+
+static void voipms_cli_complete(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data,
+   CURLcode result
+) {
+   struct VoipMsCli* cli = (struct VoipMsCli*)session->user_data;
+   struct GcFuncDataMessageList message_list =
+      { NULL, NULL, FALSE, FALSE, FALSE };
+   JsonParser* parser;
+   JsonObject* response;
+   const gchar* status;
+
+   parser = json_parser_new();
+   status = voipms_api_request_status( request_data, result, parser, &response );
+
+   switch( request_data->method ) {
+      case VOIPMS_METHOD_SENDSMS:
+         if( strcmp( status, "success" ) ) {
+            fprintf( stderr, "Unable to send message: %s\n", status );
+            cli->exit_status = EXIT_FAILURE;
+         }
+         cli->done = TRUE;
+         break;
+
+      case VOIPMS_METHOD_GETSMS:
+      case VOIPMS_METHOD_GETMMS:
+         if( NULL == response || strcmp( status, "success" ) ) {
+            /* "no_sms" just means there's nothing new. */
+            break;
+         }
+         message_list.mms = VOIPMS_METHOD_GETMMS == request_data->method;
+         voipms_api_parse_messages( response, &message_list );
+         /* The relay deletes what it passes on by itself. */
+         voipms_cli_print(
+            session, message_list.messages,
+            cli->delete_ && !request_data->relayed
+         );
+         g_list_free_full( message_list.messages, voipms_message_free );
+         break;
+
+      default:
+         if( strcmp( status, "success" ) ) {
+            fprintf( stderr, "Unable to delete message: %s\n", status );
+         }
+         break;
+   }
+
+   g_object_unref( parser );
+}
+
+static void voipms_cli_bulk_progress(
+   struct VoipMsSession* session, struct VoipMsBulk* bulk
+) {
+   struct VoipMsCli* cli = (struct VoipMsCli*)session->user_data;
+   gchar* summary;
+
+   fprintf(
+      stderr, "\r%u/%u sent, %u failed",
+      bulk->sent + bulk->failed, bulk->count, bulk->failed
+   );
+
+   if( voipms_bulk_is_done( bulk ) ) {
+      fprintf( stderr, "\n" );
+      summary = voipms_bulk_summary( bulk );
+      printf( "%s\n", summary );
+      g_free( summary );
+      if( 0 < bulk->failed ) {
+         cli->exit_status = EXIT_FAILURE;
+      }
+      cli->done = TRUE;
+   }
+}
+
+static void voipms_cli_cancel(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data
+) {
+   /* Nothing the CLI sends carries an attachment. */
+}
+
+/* Run the session until the current command is done, or we're told to stop. */
+static void voipms_cli_run(
+   struct VoipMsSession* session, struct VoipMsCli* cli, gboolean poll
+) {
+   struct curl_waitfd relay_wait;
+   time_t next_poll = 0;
+
+   while( !cli->done && !_voipms_cli_interrupted ) {
+      if( poll && time( NULL ) >= next_poll ) {
+         voipms_session_poll( session, _voipms_cli_mms );
+         next_poll = time( NULL ) + VOIPMS_POLL_SECONDS;
+      }
+
+      /* Wake up for the relay too, if we're going through one. */
+      relay_wait.fd = session->relay_fd;
+      relay_wait.events = CURL_WAIT_POLLIN | (
+         NULL != session->relay_out && 0 < session->relay_out->len ?
+            CURL_WAIT_POLLOUT : 0
+      );
+      relay_wait.revents = 0;
+      curl_multi_wait(
+         session->multi_handle, &relay_wait, 0 <= relay_wait.fd ? 1 : 0,
+         VOIPMS_CLI_WAIT_MS, NULL
+      );
+      voipms_api_request_progress( session );
+   }
+}
+
+int main( int argc, char** argv ) {
+   GOptionContext* context;
+   GError* error = NULL;
+   struct VoipMsSession* session = NULL;
+   struct VoipMsCli cli = { FALSE, FALSE, EXIT_SUCCESS, NULL };
+   GSList* api_args = NULL;
+   const gchar* password;
+   gchar* help;
+
+   context = g_option_context_new(
+      "tail | send DST MESSAGE | bulk MESSAGE DST..."
+   );
+   g_option_context_set_summary(
+      context,
+      "Print incoming SMS as they arrive, or send one, through the VOIP.ms API."
+   );
+   g_option_context_add_main_entries( context, _voipms_cli_options, NULL );
+   if( !g_option_context_parse( context, &argc, &argv, &error ) ) {
+      fprintf( stderr, "%s\n", error->message );
+      g_error_free( error );
+      cli.exit_status = EXIT_FAILURE;
+      goto main_cleanup;
+   }
+
+   password = NULL != _voipms_cli_password ?
+      _voipms_cli_password : g_getenv( "VOIPMS_API_PASSWORD" );
+   if(
+      NULL == _voipms_cli_relay &&
+      (NULL == _voipms_cli_username || NULL == password)
+   ) {
+      fprintf( stderr, "A username and API password are required.\n" );
+      cli.exit_status = EXIT_FAILURE;
+      goto main_cleanup;
+   }
+   if( NULL == _voipms_cli_did ) {
+      fprintf( stderr, "A DID is required.\n" );
+      cli.exit_status = EXIT_FAILURE;
+      goto main_cleanup;
+   }
+
+   g_log_set_handler(
+      "voipms", G_LOG_LEVEL_MASK, voipms_cli_log_handler, NULL
+   );
+   signal( SIGINT, voipms_cli_interrupt );
+   signal( SIGTERM, voipms_cli_interrupt );
+   curl_global_init( CURL_GLOBAL_ALL );
+
+   session = voipms_session_new(
+      _voipms_cli_username,
+      password,
+      NULL != _voipms_cli_api_url ? _voipms_cli_api_url : VOIPMS_API_URL,
+      _voipms_cli_did,
+      !_voipms_cli_get
+   );
+   session->complete = voipms_cli_complete;
+   session->cancel = voipms_cli_cancel;
+   session->user_data = &cli;
+   if( 0 < _voipms_cli_budget ) {
+      voipms_session_set_budget( session, (guint64)_voipms_cli_budget * 1024 );
+   }
+   if( NULL != _voipms_cli_relay ) {
+      voipms_relay_open( session, _voipms_cli_relay );
+   }
+
+   if( 2 == argc && !strcmp( argv[1], "tail" ) ) {
+      cli.delete_ = _voipms_cli_delete;
+      if( !cli.delete_ ) {
+         cli.seen = g_hash_table_new_full(
+            g_str_hash, g_str_equal, g_free, NULL
+         );
+      }
+      voipms_cli_run( session, &cli, TRUE );
+
+   } else if( 4 == argc && !strcmp( argv[1], "send" ) ) {
+      api_args = voipms_api_args_add( api_args, "did", _voipms_cli_did );
+      api_args = voipms_api_args_add( api_args, "dst", argv[2] );
+      api_args = voipms_api_args_add( api_args, "message", argv[3] );
+      voipms_api_request( session, VOIPMS_METHOD_SENDSMS, api_args, NULL );
+      voipms_cli_run( session, &cli, FALSE );
+      if( !cli.done ) {
+         /* Interrupted before we heard back. */
+         cli.exit_status = EXIT_FAILURE;
+      }
+
+   } else if( 4 <= argc && !strcmp( argv[1], "bulk" ) ) {
+      /* Finishes, and sets done, straight away if every send fails. */
+      voipms_bulk_start(
+         session, &(argv[3]), argv[2],
+         MAX( 0, _voipms_cli_concurrency ), MAX( 0, _voipms_cli_rate ),
+         voipms_cli_bulk_progress, NULL, NULL
+      );
+      voipms_cli_run( session, &cli, FALSE );
+      if( !cli.done ) {
+         cli.exit_status = EXIT_FAILURE;
+      }
+
+   } else {
+      help = g_option_context_get_help( context, TRUE, NULL );
+      fprintf( stderr, "%s", help );
+      g_free( help );
+      cli.exit_status = EXIT_FAILURE;
+   }
+
+main_cleanup:
+
+   if(
+      NULL != session && NULL != _voipms_cli_trace &&
+      EXIT_SUCCESS != cli.exit_status
+   ) {
+      voipms_trace_dump( _voipms_cli_trace );
+   }
+
+   if( NULL != session ) {
+      voipms_session_free( session );
+      curl_global_cleanup();
+   }
+   if( NULL != cli.seen ) {
+      g_hash_table_destroy( cli.seen );
+   }
+   g_option_context_free( context );
+
+   return cli.exit_status;
+}
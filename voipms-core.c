@@ -0,0 +1,2512 @@
+
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Logging goes through glib, so each front end can send it where it likes. */
+#define G_LOG_DOMAIN "voipms"
+
+#include "voipms-core.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static void messages_foreach_process( JsonArray*, guint, JsonNode*, gpointer );
+static void voipms_capture_args( struct RequestMemoryStruct*, GSList* );
+static void voipms_capture_write(
+   struct VoipMsSession*, struct VoipMsRequestData*, CURLcode
+);
+static void voipms_request_complete(
+   struct VoipMsSession*, struct VoipMsRequestData*, CURLcode
+);
+static void voipms_relay_request(
+   struct VoipMsSession*, struct VoipMsRequestData*, GSList*
+);
+static void voipms_relay_progress( struct VoipMsSession* );
+static void voipms_api_request_send(
+   struct VoipMsSession*, struct VoipMsRequestData*, GSList*
+);
+static void voipms_request_cancel(
+   struct VoipMsSession*, struct VoipMsRequestData*
+);
+static void voipms_bulk_pump( struct VoipMsSession*, struct VoipMsBulk* );
+static void voipms_bulk_free( gpointer );
+static void voipms_relay_close( struct VoipMsSession*, gboolean );
+
+/* Encoding */
+
+/* Bytes that can go into a form-encoded body unescaped are marked 1. Space  *
+ * is marked 2 so it can be written as '+'. Everything else, including the   *
+ * whole high half of the table, gets percent-encoded.                       */
+static const guchar voipms_form_safe[256] = {
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x00 */
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x10 */
+   2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, /* 0x20  - . */
+   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, /* 0x30 0-9 */
+   0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 0x40 A-O */
+   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, /* 0x50 P-Z _ */
+   0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 0x60 a-o */
+   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, /* 0x70 p-z */
+};
+
+static const char voipms_form_hex[] = "0123456789ABCDEF";
+
+/* The flight recorder is shared by every session in the process. */
+static struct VoipMsTraceEvent voipms_trace_ring[VOIPMS_TRACE_EVENTS];
+static gint voipms_trace_head = 0;
+static gint voipms_trace_requests = 0;
+
+gboolean voipms_buffer_reserve(
+   struct RequestMemoryStruct* mem, size_t extra
+) {
+   size_t needed = mem->size + extra + 1,
+      new_capacity = mem->capacity;
+   char* new_memory;
+
+   if( needed <= mem->capacity ) {
+      return TRUE;
+   }
+
+   /* Grow geometrically so appends are amortized. */
+   if( VOIPMS_BUFFER_MIN_SIZE > new_capacity ) {
+      new_capacity = VOIPMS_BUFFER_MIN_SIZE;
+   }
+   while( new_capacity < needed ) {
+      new_capacity *= 2;
+   }
+
+   new_memory = realloc( mem->memory, new_capacity );
+   if( NULL == new_memory ) {
+      return FALSE;
+   }
+
+   mem->memory = new_memory;
+   mem->capacity = new_capacity;
+
+   return TRUE;
+}
+
+gboolean voipms_buffer_append(
+   struct RequestMemoryStruct* mem, const char* data, size_t length
+) {
+   if( !voipms_buffer_reserve( mem, length ) ) {
+      return FALSE;
+   }
+
+   memcpy( &(mem->memory[mem->size]), data, length );
+   mem->size += length;
+   mem->memory[mem->size] = 0;
+
+   return TRUE;
+}
+
+/* Percent-encode length bytes of src onto the end of mem in a single pass.   */
+gboolean voipms_form_encode_append(
+   struct RequestMemoryStruct* mem, const char* src, size_t length
+) {
+   const guchar* in = (const guchar*)src,
+      * end = in + length,
+      * run;
+   char* out;
+
+   /* Reserve the worst case up front so the loop never has to reallocate. */
+   if( !voipms_buffer_reserve( mem, length * 3 ) ) {
+      return FALSE;
+   }
+   out = &(mem->memory[mem->size]);
+
+   while( in < end ) {
+      /* Copy runs of safe bytes in one go. */
+      run = in;
+      while( in < end && 1 == voipms_form_safe[*in] ) {
+         in++;
+      }
+      if( in > run ) {
+         memcpy( out, run, in - run );
+         out += in - run;
+      }
+
+      if( in >= end ) {
+         break;
+      }
+
+      if( 2 == voipms_form_safe[*in] ) {
+         *out++ = '+';
+      } else {
+         *out++ = '%';
+         *out++ = voipms_form_hex[*in >> 4];
+         *out++ = voipms_form_hex[*in & 0x0f];
+      }
+      in++;
+   }
+
+   mem->size = out - mem->memory;
+   mem->memory[mem->size] = 0;
+
+   return TRUE;
+}
+
+/* Append binary data as a base64 data URI, encoding it in fixed-size chunks *
+ * so we never hold a second full copy of it.                                 */
+static gboolean voipms_form_encode_data_append(
+   struct RequestMemoryStruct* mem, const struct VoipMsApiArg* arg
+) {
+   size_t offset,
+      step;
+   gchar* prefix;
+   gchar out[VOIPMS_BASE64_CHUNK_SIZE / 3 * 4 + 8];
+   gsize out_length;
+   gint state = 0,
+      save = 0;
+   gboolean encoded;
+
+   prefix = g_strdup_printf( "data:%s;base64,", arg->mime );
+   encoded = voipms_form_encode_append( mem, prefix, strlen( prefix ) );
+   g_free( prefix );
+
+   for( offset = 0; encoded && offset < arg->data_size; offset += step ) {
+      step = MIN( VOIPMS_BASE64_CHUNK_SIZE, arg->data_size - offset );
+      out_length = g_base64_encode_step(
+         &(arg->data[offset]), step, FALSE, out, &state, &save
+      );
+      encoded = voipms_form_encode_append( mem, out, out_length );
+   }
+
+   if( encoded ) {
+      out_length = g_base64_encode_close( FALSE, out, &state, &save );
+      encoded = voipms_form_encode_append( mem, out, out_length );
+   }
+
+   return encoded;
+}
+
+GSList* voipms_api_args_add(
+   GSList* args, const gchar* key, const gchar* value
+) {
+   struct VoipMsApiArg* arg;
+
+   arg = calloc( 1, sizeof( struct VoipMsApiArg ) );
+   arg->key = g_strdup( key );
+   arg->value = g_strdup( NULL != value ? value : "" );
+
+   return g_slist_append( args, arg );
+}
+
+/* data has to stay put until the args are freed, which releases owner. */
+GSList* voipms_api_args_add_data(
+   GSList* args, const gchar* key, const gchar* mime, const guchar* data,
+   gsize size, gpointer owner, GDestroyNotify owner_free
+) {
+   struct VoipMsApiArg* arg;
+
+   arg = calloc( 1, sizeof( struct VoipMsApiArg ) );
+   arg->key = g_strdup( key );
+   arg->mime = g_strdup( mime );
+   arg->data = data;
+   arg->data_size = size;
+   arg->data_owner = owner;
+   arg->data_owner_free = owner_free;
+
+   return g_slist_append( args, arg );
+}
+
+void voipms_api_args_free( gpointer data ) {
+   struct VoipMsApiArg* arg = (struct VoipMsApiArg*)data;
+
+   g_free( arg->key );
+   g_free( arg->value );
+   g_free( arg->mime );
+   if( NULL != arg->data_owner_free ) {
+      arg->data_owner_free( arg->data_owner );
+   }
+   free( arg );
+}
+
+/* Encode args into form, replacing what was there. If url is given, it goes  *
+ * in front as a query string.                                                */
+gboolean voipms_api_build_form(
+   struct RequestMemoryStruct* form, GSList* args, const char* url
+) {
+   GSList* arg_iter;
+   struct VoipMsApiArg* arg;
+   gboolean encoded = TRUE;
+
+   form->size = 0;
+   if( NULL != url ) {
+      encoded = encoded &&
+         voipms_buffer_append( form, url, strlen( url ) ) &&
+         voipms_buffer_append( form, "?", 1 );
+   }
+
+   for( arg_iter = args; NULL != arg_iter; arg_iter = g_slist_next( arg_iter ) ) {
+      arg = (struct VoipMsApiArg*)arg_iter->data;
+      if( arg_iter != args ) {
+         encoded = encoded && voipms_buffer_append( form, "&", 1 );
+      }
+      encoded = encoded &&
+         voipms_buffer_append( form, arg->key, strlen( arg->key ) ) &&
+         voipms_buffer_append( form, "=", 1 );
+      if( NULL != arg->data ) {
+         encoded = encoded && voipms_form_encode_data_append( form, arg );
+      } else {
+         encoded = encoded &&
+            voipms_form_encode_append( form, arg->value, strlen( arg->value ) );
+      }
+   }
+
+   return encoded;
+}
+
+/* Requests */
+
+struct VoipMsSession* voipms_session_new(
+   const gchar* username, const gchar* password, const gchar* api_url,
+   const gchar* did, gboolean use_post
+) {
+   struct VoipMsSession* session;
+
+   session = calloc( 1, sizeof( struct VoipMsSession ) );
+   session->username = g_strdup( username );
+   session->password = g_strdup( password );
+   session->api_url = g_strdup( NULL != api_url ? api_url : VOIPMS_API_URL );
+   session->did = g_strdup( NULL != did ? did : "" );
+   session->send_did = g_strdup( session->did );
+   session->use_post = use_post;
+
+   /* Setup the CURL multi handle. */
+   session->multi_handle = curl_multi_init();
+
+   curl_multi_setopt(
+      session->multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX
+   );
+
+   session->requests = g_hash_table_new( g_direct_hash, g_direct_equal );
+   session->relay_fd = -1;
+
+   return session;
+}
+
+void voipms_session_free( struct VoipMsSession* session ) {
+   GHashTableIter iter;
+   gpointer curl,
+      request_data;
+
+   /* Cancel whatever's still in flight. Nothing completes after this, so   *
+    * nothing can touch the front end's state once it's gone.               */
+   g_hash_table_iter_init( &iter, session->requests );
+   while( g_hash_table_iter_next( &iter, &curl, &request_data ) ) {
+      curl_multi_remove_handle( session->multi_handle, (CURL*)curl );
+      curl_easy_cleanup( (CURL*)curl );
+      voipms_request_cancel( session, request_data );
+      voipms_request_data_free( (struct VoipMsRequestData*)request_data );
+      g_hash_table_iter_remove( &iter );
+   }
+   g_hash_table_destroy( session->requests );
+
+   if( NULL != session->relay_path ) {
+      voipms_relay_close( session, TRUE );
+      g_hash_table_destroy( session->relay_requests );
+      g_free( session->relay_path );
+   }
+
+   /* Nothing of theirs is in flight any more, so the bulks can go too. */
+   g_list_free_full( session->bulks, voipms_bulk_free );
+
+   /* Shut down CURL. */
+   curl_multi_cleanup( session->multi_handle );
+
+   /* Outbox entries that were in flight stay in the file for next time. */
+   if( NULL != session->outbox.ids ) {
+      voipms_outbox_close( session );
+   }
+   voipms_capture_close( session );
+
+   /* Don't keep credentials lying around in the buffer. */
+   if( NULL != session->password ) {
+      memset( session->password, 0, strlen( session->password ) );
+   }
+   free( session->form_buffer.memory );
+   g_free( session->username );
+   g_free( session->password );
+   g_free( session->api_url );
+   g_free( session->did );
+   g_free( session->send_did );
+   free( session );
+}
+
+/* Ask for everything the API will give us, unless we're still waiting on   *
+ * the last time we asked. Returns TRUE if a poll went out.                  */
+gboolean voipms_session_poll( struct VoipMsSession* session, gboolean mms ) {
+   time_t to_rawtime,
+      from_rawtime;
+   struct tm* to_timeinfo,
+      * from_timeinfo;
+   char from_filter_date[VOIPMS_DATE_BUFFER_SIZE] = { 0 },
+      to_filter_date[VOIPMS_DATE_BUFFER_SIZE] = { 0 };
+   GSList* api_args = NULL;
+
+   /* The relay polls for everyone, and passes on whatever it finds. */
+   if( NULL != session->relay_path ) {
+      return FALSE;
+   }
+
+   /* Over budget; wait for it to catch up, which stretches the interval. */
+   if( 0 < voipms_session_poll_delay( session ) ) {
+      return FALSE;
+   }
+
+   /* Don't pile on getSMS requests. */
+   if( 0 < session->polls_in_flight ) {
+      return FALSE;
+   }
+
+   /* Calculate as wide a range as the API will allow us. */
+   /* TODO: Use glib functions for this? */
+   time( &from_rawtime );
+   from_rawtime -= VOIPMS_DAY_SECONDS * VOIPMS_MAX_AGE_DAYS;
+   /* Nothing from before the newest message we've seen needs asking for   *
+    * again. The filter only goes by date, so leave a day's slack.          */
+   if( 0 < session->poll_since ) {
+      from_rawtime = MAX(
+         from_rawtime,
+         MIN( session->poll_since, time( NULL ) ) - VOIPMS_DAY_SECONDS
+      );
+   }
+   from_timeinfo = localtime( &from_rawtime );
+   strftime( from_filter_date, VOIPMS_DATE_BUFFER_SIZE, "%F", from_timeinfo );
+
+   time( &to_rawtime );
+   to_timeinfo = localtime( &to_rawtime );
+   strftime( to_filter_date, VOIPMS_DATE_BUFFER_SIZE, "%F", to_timeinfo );
+
+   /* Build and send the API request. */
+   api_args = voipms_api_args_add( api_args, "from", from_filter_date );
+   api_args = voipms_api_args_add( api_args, "to", to_filter_date );
+   api_args = voipms_api_args_add( api_args, "type", "1" );
+   api_args = voipms_api_args_add( api_args, "did", session->did );
+
+   voipms_trace( VOIPMS_TRACE_POLL, VOIPMS_METHOD_GETSMS, 0, 0, 0, 0, 0 );
+   voipms_api_request( session, VOIPMS_METHOD_GETSMS, api_args, NULL );
+
+   if( mms ) {
+      api_args = NULL;
+      api_args = voipms_api_args_add( api_args, "from", from_filter_date );
+      api_args = voipms_api_args_add( api_args, "to", to_filter_date );
+      api_args = voipms_api_args_add( api_args, "type", "1" );
+      api_args = voipms_api_args_add( api_args, "did", session->did );
+      voipms_api_request( session, VOIPMS_METHOD_GETMMS, api_args, NULL );
+   }
+
+   return TRUE;
+}
+
+/* A token bucket: budget trickles in by the second, up to a minute's worth, *
+ * and every finished transfer spends what it moved.                        */
+static void voipms_budget_refill( struct VoipMsSession* session ) {
+   gint64 now = g_get_monotonic_time();
+   gdouble per_second = (gdouble)session->budget / 3600,
+      burst = per_second * VOIPMS_BUDGET_BURST_SECONDS;
+
+   session->budget_tokens = MIN(
+      burst,
+      session->budget_tokens +
+         per_second * (now - session->budget_refilled) / G_USEC_PER_SEC
+   );
+   session->budget_refilled = now;
+}
+
+void voipms_session_set_budget(
+   struct VoipMsSession* session, guint64 bytes_per_hour
+) {
+   session->budget = bytes_per_hour;
+   session->budget_tokens =
+      (gdouble)bytes_per_hour / 3600 * VOIPMS_BUDGET_BURST_SECONDS;
+   session->budget_refilled = g_get_monotonic_time();
+}
+
+/* Seconds until the budget allows another poll; 0 if it does now. */
+guint voipms_session_poll_delay( struct VoipMsSession* session ) {
+   if( 0 == session->budget ) {
+      return 0;
+   }
+
+   voipms_budget_refill( session );
+   if( 0 <= session->budget_tokens ) {
+      return 0;
+   }
+
+   return MIN(
+      VOIPMS_BUDGET_MAX_DELAY,
+      (guint)(-session->budget_tokens * 3600 / session->budget) + 1
+   );
+}
+
+/* Count what a finished transfer moved, as best libcurl can tell us. */
+static void voipms_traffic_count(
+   struct VoipMsSession* session, CURL* curl,
+   struct VoipMsRequestData* request_data
+) {
+   curl_off_t download = 0,
+      upload = 0;
+   long header_size = 0,
+      request_size = 0;
+   guint64 sent,
+      received;
+
+   curl_easy_getinfo( curl, CURLINFO_SIZE_DOWNLOAD_T, &download );
+   curl_easy_getinfo( curl, CURLINFO_SIZE_UPLOAD_T, &upload );
+   curl_easy_getinfo( curl, CURLINFO_HEADER_SIZE, &header_size );
+   curl_easy_getinfo( curl, CURLINFO_REQUEST_SIZE, &request_size );
+
+   sent = (guint64)request_size + upload;
+   received = (guint64)header_size + download;
+
+   session->traffic.requests++;
+   session->traffic.sent += sent;
+   session->traffic.received += received;
+   session->traffic.decoded += VOIPMS_METHOD_MEDIA == request_data->method ?
+      (guint64)download : request_data->chunk.size;
+
+   if( 0 < session->budget ) {
+      voipms_budget_refill( session );
+      session->budget_tokens -= sent + received;
+   }
+}
+
+size_t voipms_api_request_write_body_callback(
+   void* contents, size_t size, size_t nmemb, void* userp
+) {
+   size_t realsize = size * nmemb;
+   struct RequestMemoryStruct* mem = (struct RequestMemoryStruct*)userp;
+
+   if( !voipms_buffer_append( mem, contents, realsize ) ) {
+      /* TODO: Alert to memory problems, somehow. */
+      return 0;
+   }
+
+   return realsize;
+}
+
+struct VoipMsRequestData* voipms_request_data_new(
+   struct VoipMsSession* session, VOIPMS_METHOD method, void* attachment
+) {
+   struct VoipMsRequestData* request_data;
+
+   /* Setup some buffers and stuff. */
+   request_data = calloc( 1, sizeof( struct VoipMsRequestData ) );
+   request_data->method = method;
+   request_data->attachment = attachment;
+   request_data->error_buffer = calloc( CURL_ERROR_SIZE, sizeof( char ) );
+   request_data->chunk.memory = calloc( 1, sizeof( char ) );
+   request_data->chunk.size = 0;
+   request_data->chunk.capacity = 1;
+   request_data->trace_id =
+      (guint32)g_atomic_int_add( &voipms_trace_requests, 1 ) + 1;
+
+   if( voipms_request_is_poll( request_data ) ) {
+      session->polls_in_flight++;
+   }
+
+   return request_data;
+}
+
+void voipms_request_data_free( struct VoipMsRequestData* request_data ) {
+   free( request_data->capture_args.memory );
+   free( request_data->chunk.memory );
+   free( request_data->error_buffer );
+   free( request_data );
+}
+
+gboolean voipms_request_is_poll(
+   const struct VoipMsRequestData* request_data
+) {
+   /* getSMS with an attachment is a history page, not a poll. */
+   return NULL == request_data->attachment && (
+      VOIPMS_METHOD_GETSMS == request_data->method ||
+      VOIPMS_METHOD_GETMMS == request_data->method
+   );
+}
+
+/* Let whoever owns the attachment of a request that will never complete    *
+ * release it. The core's own attachments are plain allocations.            */
+static void voipms_request_cancel(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data
+) {
+   if( NULL != request_data->complete ) {
+      free( request_data->attachment );
+   } else if( NULL != session->cancel ) {
+      session->cancel( session, request_data );
+   }
+}
+
+/* Finish off a request that never made it out, or one that just came back. */
+static void voipms_request_complete(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data,
+   CURLcode result
+) {
+   if(
+      !request_data->replayed && !request_data->relayed &&
+      voipms_request_is_poll( request_data )
+   ) {
+      session->polls_in_flight--;
+   }
+
+   /* Requests that failed before going out were never started, so they    *
+    * didn't spend any time on the wire.                                     */
+   if( !request_data->replayed ) {
+      voipms_trace(
+         VOIPMS_TRACE_FINISH, request_data->method, request_data->trace_id,
+         (guint16)result, (guint32)request_data->chunk.size,
+         0 == request_data->started ? 0 :
+            (guint32)(g_get_monotonic_time() - request_data->started), 0
+      );
+   }
+
+   if( NULL != request_data->complete ) {
+      request_data->complete( session, request_data, result );
+   } else if( NULL != session->complete ) {
+      session->complete( session, request_data, result );
+   }
+   voipms_request_data_free( request_data );
+}
+
+void voipms_request_start(
+   struct VoipMsSession* session, CURL* curl,
+   struct VoipMsRequestData* request_data
+) {
+   curl_easy_setopt( curl, CURLOPT_PRIVATE, request_data );
+   curl_easy_setopt( curl, CURLOPT_ERRORBUFFER, request_data->error_buffer );
+   curl_easy_setopt( curl, CURLOPT_FAILONERROR, 1 );
+   request_data->started = g_get_monotonic_time();
+   voipms_trace(
+      VOIPMS_TRACE_START, request_data->method, request_data->trace_id,
+      0, 0, 0, 0
+   );
+
+   /* Everything in flight is registered, so it can be cancelled on close. */
+   g_hash_table_insert( session->requests, curl, request_data );
+   curl_multi_add_handle( session->multi_handle, curl );
+}
+
+void voipms_api_request(
+   struct VoipMsSession* session, VOIPMS_METHOD method, GSList* args,
+   void* attachment
+) {
+   voipms_api_request_send(
+      session, voipms_request_data_new( session, method, attachment ), args
+   );
+}
+
+static void voipms_api_request_send(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data,
+   GSList* args
+) {
+   CURL* curl = NULL;
+   struct RequestMemoryStruct* form = &(session->form_buffer);
+   VOIPMS_METHOD method = request_data->method;
+
+   if( NULL != session->relay_path ) {
+      /* The relay has credentials of its own, so ours never leave here. */
+      voipms_relay_request( session, request_data, args );
+      return;
+   }
+
+   /* Add the credentials to the request. */
+   args = voipms_api_args_add( args, "api_username", session->username );
+   args = voipms_api_args_add( args, "api_password", session->password );
+
+   /* Add the method to the request. */
+   if( VOIPMS_METHOD_MEDIA != method ) {
+      args = voipms_api_args_add(
+         args, "method", voipms_method_name( method )
+      );
+   }
+
+   if( NULL != session->capture ) {
+      voipms_capture_args( &(request_data->capture_args), args );
+   }
+
+   /* Encode the arguments into the reusable buffer. A GET request carries    *
+    * them in the query string, so the URL goes in front of them.             */
+   if(
+      !voipms_api_build_form(
+         form, args, session->use_post ? NULL : session->api_url
+      )
+   ) {
+      g_warning( "Unable to allocate request buffer." );
+
+      /* Finish it as a failure so the attachment's owner hears about it. */
+      voipms_request_complete( session, request_data, CURLE_OUT_OF_MEMORY );
+      goto api_request_cleanup;
+   }
+
+   /* Setup the request. */
+   curl = curl_easy_init();
+   if( session->use_post ) {
+      /* libcurl sends these as application/x-www-form-urlencoded. */
+      curl_easy_setopt( curl, CURLOPT_URL, session->api_url );
+      curl_easy_setopt( curl, CURLOPT_POSTFIELDSIZE, (long)form->size );
+      curl_easy_setopt( curl, CURLOPT_COPYPOSTFIELDS, form->memory );
+   } else {
+      curl_easy_setopt( curl, CURLOPT_URL, form->memory );
+   }
+   curl_easy_setopt(
+      curl, CURLOPT_WRITEFUNCTION, voipms_api_request_write_body_callback
+   );
+   curl_easy_setopt( curl, CURLOPT_WRITEDATA, &(request_data->chunk) );
+
+   /* Offer every encoding libcurl was built with. It inflates each piece   *
+    * as it arrives, so the write callback only ever sees plain JSON and   *
+    * the compressed body is never held in full.                           */
+   curl_easy_setopt( curl, CURLOPT_ACCEPT_ENCODING, "" );
+
+   voipms_request_start( session, curl, request_data );
+
+api_request_cleanup:
+
+   /* Don't keep credentials lying around in the buffer. */
+   if( NULL != form->memory ) {
+      memset( form->memory, 0, form->size );
+   }
+   form->size = 0;
+
+   g_slist_free_full( args, voipms_api_args_free );
+
+}
+
+void voipms_api_request_progress( struct VoipMsSession* session ) {
+   int queue_count;
+   struct CURLMsg* msg = NULL;
+   struct VoipMsRequestData* request_data = NULL;
+   CURL* curl;
+   CURLcode result;
+   GList* bulks,
+      * bulk_iter;
+
+   if( NULL != session->relay_path ) {
+      voipms_relay_progress( session );
+   }
+
+   /* Top up whatever's being bulk sent, as far as the caps allow. A bulk   *
+    * can finish and go away while it's pumped, so walk a copy.             */
+   bulks = g_list_copy( session->bulks );
+   for(
+      bulk_iter = bulks;
+      NULL != bulk_iter;
+      bulk_iter = g_list_next( bulk_iter )
+   ) {
+      voipms_bulk_pump( session, bulk_iter->data );
+   }
+   g_list_free( bulks );
+
+   curl_multi_perform( session->multi_handle, &(session->still_running) );
+
+   /* Handle everything that's finished since the last check. */
+   while(
+      NULL != (msg = curl_multi_info_read(
+         session->multi_handle, &queue_count
+      ))
+   ) {
+      if( CURLMSG_DONE != msg->msg ) {
+         continue;
+      }
+
+      /* msg is gone once the handle is removed, so copy what we need. */
+      curl = msg->easy_handle;
+      result = msg->data.result;
+
+      /* Take it out of the registry first, so it's ours alone now. */
+      request_data = g_hash_table_lookup( session->requests, curl );
+      g_hash_table_remove( session->requests, curl );
+      if( NULL != request_data ) {
+         voipms_traffic_count( session, curl, request_data );
+      }
+      curl_multi_remove_handle( session->multi_handle, curl );
+      curl_easy_cleanup( curl );
+
+      if( NULL == request_data ) {
+         /* Don't know how to handle this. */
+         g_debug( "NULL request_data returned for request." );
+         continue;
+      }
+
+      voipms_capture_write( session, request_data, result );
+      voipms_request_complete( session, request_data, result );
+   }
+}
+
+/* Responses */
+
+const gchar* voipms_json_get_string(
+   JsonObject* object, const gchar* member
+) {
+   JsonNode* node;
+
+   if( NULL == object || !json_object_has_member( object, member ) ) {
+      return NULL;
+   }
+
+   /* Returns NULL for non-string values, too. */
+   node = json_object_get_member( object, member );
+   if( !JSON_NODE_HOLDS_VALUE( node ) ) {
+      return NULL;
+   }
+
+   return json_node_get_string( node );
+}
+
+gboolean voipms_parse_date( const gchar* date, struct tm* timeinfo ) {
+   memset( timeinfo, 0, sizeof( struct tm ) );
+
+   if( NULL == date ) {
+      return FALSE;
+   }
+
+   return NULL != strptime( date, "%Y-%m-%d %H:%M:%S", timeinfo );
+}
+
+/* Parse an API response body. The object belongs to parser, and NULL means   *
+ * the body wasn't an API response at all.                                    */
+JsonObject* voipms_api_parse_response(
+   JsonParser* parser, const char* data, size_t size
+) {
+   JsonNode* root;
+
+   if( !json_parser_load_from_data( parser, data, size, NULL ) ) {
+      return NULL;
+   }
+
+   root = json_parser_get_root( parser );
+   if( NULL == root || !JSON_NODE_HOLDS_OBJECT( root ) ) {
+      return NULL;
+   }
+
+   return json_node_get_object( root );
+}
+
+/* Pull the messages out of a getSMS/getMMS response, oldest first. */
+void voipms_api_parse_messages(
+   JsonObject* response, struct GcFuncDataMessageList* message_list
+) {
+   JsonNode* sms;
+
+   if( !json_object_has_member( response, "sms" ) ) {
+      return;
+   }
+
+   sms = json_object_get_member( response, "sms" );
+   if( !JSON_NODE_HOLDS_ARRAY( sms ) ) {
+      return;
+   }
+
+   json_array_foreach_element(
+      json_node_get_array( sms ), messages_foreach_process, message_list
+   );
+}
+
+/* Work out how a finished request went. Returns the API's status, or why    *
+ * there isn't one; response is only set if there is. It belongs to parser.  */
+const gchar* voipms_api_request_status(
+   struct VoipMsRequestData* request_data, CURLcode result, JsonParser* parser,
+   JsonObject** response
+) {
+   const gchar* status;
+
+   *response = NULL;
+
+   if( CURLE_OK != result ) {
+      status = '\0' != request_data->error_buffer[0] ?
+         request_data->error_buffer : curl_easy_strerror( result );
+      g_warning( "Request failed: %s", status );
+      return status;
+   }
+
+   /* Parse the JSON response. */
+   *response = voipms_api_parse_response(
+      parser, request_data->chunk.memory, request_data->chunk.size
+   );
+   if( NULL == *response ) {
+      /* The body can hold messages, so only its size goes in the logs. */
+      g_warning(
+         "Unable to parse a %" G_GSIZE_FORMAT " byte response.",
+         request_data->chunk.size
+      );
+      voipms_trace(
+         VOIPMS_TRACE_BAD_RESPONSE, request_data->method,
+         request_data->trace_id, 0, (guint32)request_data->chunk.size, 0, 0
+      );
+      return "invalid response";
+   }
+
+   /* Get the status of the request. */
+   status = voipms_json_get_string( *response, "status" );
+   if( NULL == status ) {
+      status = "";
+   }
+   if( strcmp( status, "success" ) ) {
+      voipms_trace(
+         VOIPMS_TRACE_STATUS, request_data->method, request_data->trace_id,
+         voipms_trace_status_code( status ), 0, 0, 0
+      );
+   }
+
+   return status;
+}
+
+void voipms_message_free( gpointer data ) {
+   struct VoipMsMessage* message = (struct VoipMsMessage*)data;
+
+   if( NULL == message ) {
+      return;
+   }
+
+   g_free( message->id );
+   g_free( message->contact );
+   g_free( message->message );
+   g_list_free_full( message->media, g_free );
+   free( message );
+}
+
+static void messages_foreach_process(
+   JsonArray* array, guint index_, JsonNode* element_node, gpointer user_data
+) {
+   struct GcFuncDataMessageList* gcfdata =
+      (struct GcFuncDataMessageList*)user_data;
+   JsonObject* message_json;
+   struct VoipMsMessage* message;
+   const gchar* type,
+      * media_url;
+   JsonArray* media = NULL;
+   JsonNode* media_node;
+   gchar media_key[16];
+   guint i;
+
+   if( !JSON_NODE_HOLDS_OBJECT( element_node ) ) {
+      return;
+   }
+   message_json = json_node_get_object( element_node );
+
+   /* There's nobody to show it to without a contact. */
+   if( NULL == voipms_json_get_string( message_json, "contact" ) ) {
+      return;
+   }
+
+   /* Parse/translate message metadata. */
+   message = calloc( 1, sizeof( struct VoipMsMessage ) );
+   message->id = g_strdup( voipms_json_get_string( message_json, "id" ) );
+   message->contact =
+      g_strdup( voipms_json_get_string( message_json, "contact" ) );
+   message->message =
+      g_strdup( voipms_json_get_string( message_json, "message" ) );
+   type = voipms_json_get_string( message_json, "type" );
+   message->outgoing = NULL != type && !strcmp( type, "0" );
+   message->account = gcfdata->account;
+   voipms_parse_date(
+      voipms_json_get_string( message_json, "date" ), &(message->timeinfo)
+   );
+
+   if( gcfdata->mms ) {
+      /* Attachments come as a media array, or as col_media1-3 strings. */
+      if( json_object_has_member( message_json, "media" ) ) {
+         media_node = json_object_get_member( message_json, "media" );
+         if( JSON_NODE_HOLDS_ARRAY( media_node ) ) {
+            media = json_node_get_array( media_node );
+         }
+         for( i = 0; NULL != media && i < json_array_get_length( media ); i++ ) {
+            media_node = json_array_get_element( media, i );
+            media_url = JSON_NODE_HOLDS_VALUE( media_node ) ?
+               json_node_get_string( media_node ) : NULL;
+            if( NULL != media_url && '\0' != media_url[0] ) {
+               message->media =
+                  g_list_append( message->media, g_strdup( media_url ) );
+            }
+         }
+      } else {
+         for( i = 1; VOIPMS_MMS_MAX_MEDIA >= i; i++ ) {
+            g_snprintf( media_key, sizeof( media_key ), "col_media%u", i );
+            media_url = voipms_json_get_string( message_json, media_key );
+            if( NULL != media_url && '\0' != media_url[0] ) {
+               message->media =
+                  g_list_append( message->media, g_strdup( media_url ) );
+            }
+         }
+      }
+   }
+
+   if( gcfdata->mms && NULL == message->media ) {
+      /* Plain text messages are picked up by getSMS. */
+      voipms_message_free( message );
+      return;
+   }
+   message->mms = gcfdata->mms;
+   if( NULL == message->message ) {
+      message->message = g_strdup( "" );
+   }
+
+   /* The API lists newest first, so prepending leaves the list oldest first *
+    * without walking it on every message.                                   */
+   gcfdata->messages = g_list_prepend( gcfdata->messages, message );
+}
+
+/* Outbox */
+
+/* sendSMS statuses that will fail the same way however often we retry. */
+static const gchar* voipms_outbox_final_statuses[] = {
+   "invalid_dst",
+   "invalid_message",
+   "message_empty",
+   "missing_dst",
+   "missing_message",
+   "sms_toolong",
+   NULL
+};
+
+gboolean voipms_outbox_status_is_final( const gchar* status ) {
+   int i;
+
+   for( i = 0; NULL != voipms_outbox_final_statuses[i]; i++ ) {
+      if( !strcmp( status, voipms_outbox_final_statuses[i] ) ) {
+         return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+static void voipms_outbox_entry_free( gpointer data ) {
+   struct VoipMsOutboxEntry* entry = (struct VoipMsOutboxEntry*)data;
+
+   g_free( entry->cid );
+   g_free( entry->dst );
+   g_free( entry->message );
+   free( entry );
+}
+
+static void voipms_outbox_write_add(
+   GString* out, struct VoipMsOutboxEntry* entry
+) {
+   /* The length prefix lets the message itself contain newlines. */
+   g_string_append_printf(
+      out, "+ %s %s %lu\n",
+      entry->cid, entry->dst, (unsigned long)strlen( entry->message )
+   );
+   g_string_append( out, entry->message );
+   g_string_append_c( out, '\n' );
+}
+
+static void voipms_outbox_append( struct VoipMsOutbox* outbox, GString* out ) {
+   if( NULL == outbox->file ) {
+      return;
+   }
+
+   /* Push it to the kernel now; the fsync waits for the next timer tick. */
+   fwrite( out->str, 1, out->len, outbox->file );
+   fflush( outbox->file );
+   outbox->dirty = TRUE;
+}
+
+void voipms_outbox_sync( struct VoipMsSession* session ) {
+   struct VoipMsOutbox* outbox = &(session->outbox);
+
+   if( NULL == outbox->file || !outbox->dirty ) {
+      return;
+   }
+
+   fsync( fileno( outbox->file ) );
+   outbox->dirty = FALSE;
+}
+
+static struct VoipMsOutboxEntry* voipms_outbox_insert(
+   struct VoipMsOutbox* outbox, const gchar* cid, const gchar* dst,
+   const gchar* message
+) {
+   struct VoipMsOutboxEntry* entry;
+
+   if( g_hash_table_contains( outbox->ids, cid ) ) {
+      return NULL;
+   }
+
+   entry = calloc( 1, sizeof( struct VoipMsOutboxEntry ) );
+   entry->cid = g_strdup( cid );
+   entry->dst = g_strdup( dst );
+   entry->message = g_strdup( message );
+   g_queue_push_tail( &(outbox->entries), entry );
+   g_hash_table_insert( outbox->ids, entry->cid, entry );
+
+   return entry;
+}
+
+static void voipms_outbox_remove(
+   struct VoipMsOutbox* outbox, struct VoipMsOutboxEntry* entry
+) {
+   g_queue_remove( &(outbox->entries), entry );
+   g_hash_table_remove( outbox->ids, entry->cid );
+   voipms_outbox_entry_free( entry );
+}
+
+static void voipms_outbox_load( struct VoipMsOutbox* outbox ) {
+   gchar* contents = NULL,
+      * line,
+      ** fields;
+   const gchar* pos,
+      * end,
+      * line_end;
+   gsize length = 0,
+      message_length;
+   gchar* message;
+   struct VoipMsOutboxEntry* entry;
+
+   if( !g_file_get_contents( outbox->path, &contents, &length, NULL ) ) {
+      return;
+   }
+
+   pos = contents;
+   end = contents + length;
+   while( pos < end ) {
+      line_end = memchr( pos, '\n', end - pos );
+      if( NULL == line_end ) {
+         /* Torn write at the end of the file. */
+         break;
+      }
+      line = g_strndup( pos, line_end - pos );
+      pos = line_end + 1;
+      fields = g_strsplit( line, " ", 4 );
+      g_free( line );
+
+      if( !strcmp( fields[0], "+" ) && 4 == g_strv_length( fields ) ) {
+         message_length = g_ascii_strtoull( fields[3], NULL, 10 );
+         if( message_length >= (gsize)(end - pos) ) {
+            g_strfreev( fields );
+            break;
+         }
+         message = g_strndup( pos, message_length );
+         voipms_outbox_insert( outbox, fields[1], fields[2], message );
+         g_free( message );
+         pos += message_length + 1;
+
+      } else if( !strcmp( fields[0], "-" ) && 2 == g_strv_length( fields ) ) {
+         entry = g_hash_table_lookup( outbox->ids, fields[1] );
+         if( NULL != entry ) {
+            voipms_outbox_remove( outbox, entry );
+         }
+      }
+
+      g_strfreev( fields );
+   }
+
+   g_free( contents );
+}
+
+void voipms_outbox_open( struct VoipMsSession* session, const gchar* path ) {
+   struct VoipMsOutbox* outbox = &(session->outbox);
+   GString* compacted;
+   GList* iter;
+
+   g_queue_init( &(outbox->entries) );
+   outbox->ids = g_hash_table_new( g_str_hash, g_str_equal );
+   outbox->busy = g_hash_table_new( g_str_hash, g_str_equal );
+   outbox->path = g_strdup( path );
+
+   /* Replay whatever was left over last time, then compact the file down to *
+    * just those sends so it doesn't grow forever.                           */
+   voipms_outbox_load( outbox );
+   compacted = g_string_new( NULL );
+   for( iter = outbox->entries.head; NULL != iter; iter = g_list_next( iter ) ) {
+      voipms_outbox_write_add( compacted, iter->data );
+   }
+   if(
+      !g_file_set_contents( outbox->path, compacted->str, compacted->len, NULL )
+   ) {
+      g_warning( "Unable to write %s.", outbox->path );
+   }
+   g_string_free( compacted, TRUE );
+
+   outbox->file = g_fopen( outbox->path, "ab" );
+   if( NULL == outbox->file ) {
+      g_warning( "Unable to open %s.", outbox->path );
+   }
+
+   if( 0 < g_queue_get_length( &(outbox->entries) ) ) {
+      g_debug(
+         "%u message(s) waiting in the outbox.",
+         g_queue_get_length( &(outbox->entries) )
+      );
+   }
+}
+
+void voipms_outbox_close( struct VoipMsSession* session ) {
+   struct VoipMsOutbox* outbox = &(session->outbox);
+
+   /* Anything still queued or in flight stays in the file for next time. */
+   voipms_outbox_sync( session );
+   if( NULL != outbox->file ) {
+      fclose( outbox->file );
+   }
+
+   g_queue_clear( &(outbox->entries) );
+   g_hash_table_foreach( outbox->ids, (GHFunc)voipms_outbox_entry_free, NULL );
+   g_hash_table_destroy( outbox->ids );
+   g_hash_table_destroy( outbox->busy );
+   g_free( outbox->path );
+   memset( outbox, 0, sizeof( struct VoipMsOutbox ) );
+}
+
+/* Returns FALSE, queueing nothing, if dst can't be written to the outbox. */
+gboolean voipms_outbox_add(
+   struct VoipMsSession* session, const gchar* dst, const gchar* message
+) {
+   struct VoipMsOutbox* outbox = &(session->outbox);
+   struct VoipMsOutboxEntry* entry;
+   gchar* cid;
+   GString* out;
+   const gchar* dst_iter;
+
+   /* Records are split on spaces, so a dst with one would throw off the    *
+    * length and every record after it.                                     */
+   if( NULL == dst || '\0' == dst[0] ) {
+      return FALSE;
+   }
+   for( dst_iter = dst; '\0' != *dst_iter; dst_iter++ ) {
+      if( g_ascii_isspace( *dst_iter ) ) {
+         return FALSE;
+      }
+   }
+
+   cid = g_strdup_printf(
+      "%" G_GINT64_FORMAT "-%u", g_get_real_time(), outbox->next_id++
+   );
+   entry = voipms_outbox_insert( outbox, cid, dst, message );
+   g_free( cid );
+
+   out = g_string_new( NULL );
+   voipms_outbox_write_add( out, entry );
+   voipms_outbox_append( outbox, out );
+   g_string_free( out, TRUE );
+
+   return TRUE;
+}
+
+void voipms_outbox_pump( struct VoipMsSession* session ) {
+   struct VoipMsOutbox* outbox = &(session->outbox);
+   struct VoipMsOutboxEntry* entry;
+   GList* iter;
+   GSList* api_args;
+
+   if( time( NULL ) < outbox->retry_after ) {
+      return;
+   }
+
+   /* Send to as many recipients at once as we're allowed, but only one      *
+    * message per recipient at a time so they arrive in order.               */
+   for(
+      iter = outbox->entries.head;
+      NULL != iter && VOIPMS_OUTBOX_MAX_IN_FLIGHT > outbox->in_flight;
+      iter = g_list_next( iter )
+   ) {
+      entry = (struct VoipMsOutboxEntry*)iter->data;
+      if( entry->in_flight || g_hash_table_contains( outbox->busy, entry->dst ) ) {
+         continue;
+      }
+
+      entry->in_flight = TRUE;
+      outbox->in_flight++;
+      g_hash_table_add( outbox->busy, entry->dst );
+
+      api_args = NULL;
+      api_args = voipms_api_args_add( api_args, "did", session->send_did );
+      api_args = voipms_api_args_add( api_args, "dst", entry->dst );
+      api_args = voipms_api_args_add( api_args, "message", entry->message );
+      voipms_api_request( session, VOIPMS_METHOD_SENDSMS, api_args, entry );
+   }
+}
+
+/* entry is gone once this returns, unless it's being kept for a retry. */
+void voipms_outbox_done(
+   struct VoipMsSession* session, struct VoipMsOutboxEntry* entry,
+   VOIPMS_OUTBOX_RESULT result
+) {
+   struct VoipMsOutbox* outbox = &(session->outbox);
+   GString* out;
+
+   entry->in_flight = FALSE;
+   outbox->in_flight--;
+   g_hash_table_remove( outbox->busy, entry->dst );
+
+   if( VOIPMS_OUTBOX_UNREACHABLE == result ) {
+      /* Back off for a bit; the timer will pump the outbox again. */
+      g_debug( "Unable to send; keeping message in the outbox." );
+      outbox->retry_after = time( NULL ) + VOIPMS_OUTBOX_RETRY_SECONDS;
+      return;
+   }
+
+   out = g_string_new( NULL );
+   g_string_append_printf( out, "- %s\n", entry->cid );
+   voipms_outbox_append( outbox, out );
+   g_string_free( out, TRUE );
+
+   voipms_outbox_remove( outbox, entry );
+   voipms_outbox_pump( session );
+}
+
+/* Bulk */
+
+static void voipms_bulk_free( gpointer data ) {
+   struct VoipMsBulk* bulk = (struct VoipMsBulk*)data;
+   guint i;
+
+   if( NULL != bulk->user_data_free ) {
+      bulk->user_data_free( bulk->user_data );
+   }
+   for( i = 0; bulk->count > i; i++ ) {
+      g_free( bulk->recipients[i].dst );
+      g_free( bulk->recipients[i].error );
+   }
+   g_free( bulk->recipients );
+   g_free( bulk->message );
+   free( bulk );
+}
+
+gboolean voipms_bulk_is_done( const struct VoipMsBulk* bulk ) {
+   return bulk->next >= bulk->count && 0 == bulk->in_flight;
+}
+
+/* Which recipient a bulk send was for rides along as the attachment. */
+struct VoipMsBulkSend {
+   struct VoipMsBulk* bulk;
+   guint index_;
+};
+
+static void voipms_bulk_complete(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data,
+   CURLcode result
+) {
+   struct VoipMsBulkSend* send = (struct VoipMsBulkSend*)request_data->attachment;
+   struct VoipMsBulk* bulk = send->bulk;
+   struct VoipMsBulkRecipient* recipient = &(bulk->recipients[send->index_]);
+   JsonParser* parser;
+   JsonObject* response;
+   const gchar* status;
+
+   parser = json_parser_new();
+   status = voipms_api_request_status( request_data, result, parser, &response );
+   if( NULL != response && !strcmp( status, "success" ) ) {
+      recipient->status = VOIPMS_BULK_SENT;
+      bulk->sent++;
+   } else {
+      recipient->status = VOIPMS_BULK_FAILED;
+      recipient->error = g_strdup( status );
+      bulk->failed++;
+   }
+   g_object_unref( parser );
+   free( send );
+
+   bulk->in_flight--;
+
+   if( NULL != bulk->progress ) {
+      bulk->progress( session, bulk );
+   }
+
+   /* If this finished during a pump, the pump picks up from here. */
+   if( !bulk->pumping ) {
+      voipms_bulk_pump( session, bulk );
+   }
+}
+
+/* Start as many sends as the concurrency and rate caps allow right now. */
+static void voipms_bulk_pump(
+   struct VoipMsSession* session, struct VoipMsBulk* bulk
+) {
+   struct VoipMsRequestData* request_data;
+   struct VoipMsBulkSend* send;
+   GSList* api_args;
+   gint64 now = g_get_monotonic_time();
+
+   bulk->pumping = TRUE;
+
+   /* A second's worth of sends can go at once, then they're paced. */
+   bulk->tokens = MIN(
+      bulk->rate,
+      bulk->tokens + bulk->rate * (now - bulk->refilled) / G_USEC_PER_SEC
+   );
+   bulk->refilled = now;
+
+   while(
+      bulk->next < bulk->count &&
+      bulk->in_flight < bulk->concurrency &&
+      1 <= bulk->tokens
+   ) {
+      send = calloc( 1, sizeof( struct VoipMsBulkSend ) );
+      send->bulk = bulk;
+      send->index_ = bulk->next++;
+      bulk->recipients[send->index_].status = VOIPMS_BULK_IN_FLIGHT;
+      bulk->in_flight++;
+      bulk->tokens -= 1;
+
+      api_args = NULL;
+      api_args = voipms_api_args_add( api_args, "did", session->send_did );
+      api_args = voipms_api_args_add(
+         api_args, "dst", bulk->recipients[send->index_].dst
+      );
+      api_args = voipms_api_args_add( api_args, "message", bulk->message );
+
+      request_data =
+         voipms_request_data_new( session, VOIPMS_METHOD_SENDSMS, send );
+      request_data->complete = voipms_bulk_complete;
+      voipms_api_request_send( session, request_data, api_args );
+   }
+
+   bulk->pumping = FALSE;
+
+   if( voipms_bulk_is_done( bulk ) ) {
+      session->bulks = g_list_remove( session->bulks, bulk );
+      voipms_bulk_free( bulk );
+   }
+}
+
+/* Send message to each of recipients, skipping repeats. progress is called *
+ * after each one finishes; once voipms_bulk_is_done(), the bulk is freed    *
+ * right after it returns, along with user_data. That can happen before     *
+ * this returns, if every send fails straight away.                         */
+void voipms_bulk_start(
+   struct VoipMsSession* session, gchar** recipients, const gchar* message,
+   guint concurrency, guint rate, VoipMsBulkFunc progress,
+   gpointer user_data, GDestroyNotify user_data_free
+) {
+   struct VoipMsBulk* bulk;
+   GHashTable* unique;
+   guint i;
+
+   bulk = calloc( 1, sizeof( struct VoipMsBulk ) );
+   bulk->message = g_strdup( message );
+   bulk->recipients = g_new0(
+      struct VoipMsBulkRecipient, g_strv_length( recipients )
+   );
+   unique = g_hash_table_new( g_str_hash, g_str_equal );
+   for( i = 0; NULL != recipients[i]; i++ ) {
+      if(
+         '\0' == recipients[i][0] ||
+         g_hash_table_contains( unique, recipients[i] )
+      ) {
+         continue;
+      }
+      g_hash_table_add( unique, recipients[i] );
+      bulk->recipients[bulk->count++].dst = g_strdup( recipients[i] );
+   }
+   g_hash_table_destroy( unique );
+
+   bulk->concurrency = CLAMP(
+      0 == concurrency ? VOIPMS_BULK_DEFAULT_CONCURRENCY : concurrency,
+      1, VOIPMS_BULK_MAX_CONCURRENCY
+   );
+   bulk->rate = 0 == rate ? VOIPMS_BULK_DEFAULT_RATE : rate;
+   bulk->tokens = bulk->rate;
+   bulk->refilled = g_get_monotonic_time();
+   bulk->progress = progress;
+   bulk->user_data = user_data;
+   bulk->user_data_free = user_data_free;
+
+   g_debug(
+      "Bulk sending to %u recipient(s), %u at a time, %.0f a second.",
+      bulk->count, bulk->concurrency, bulk->rate
+   );
+   /* Nobody to send to is done already; say so, so the caller isn't left  *
+    * waiting on a report that never comes.                                 */
+   if( 0 == bulk->count && NULL != progress ) {
+      progress( session, bulk );
+   }
+
+   session->bulks = g_list_append( session->bulks, bulk );
+   voipms_bulk_pump( session, bulk );
+}
+
+/* A line per recipient that didn't get it, after a count of who did. */
+gchar* voipms_bulk_summary( const struct VoipMsBulk* bulk ) {
+   GString* summary;
+   guint i;
+
+   summary = g_string_new( NULL );
+   g_string_append_printf(
+      summary, "Sent to %u of %u recipient(s)", bulk->sent, bulk->count
+   );
+   if( 0 < bulk->failed ) {
+      g_string_append_printf( summary, "; %u failed", bulk->failed );
+   }
+   g_string_append( summary, "." );
+
+   for( i = 0; bulk->count > i; i++ ) {
+      if( VOIPMS_BULK_FAILED == bulk->recipients[i].status ) {
+         g_string_append_printf(
+            summary, "\n%s: %s",
+            bulk->recipients[i].dst, bulk->recipients[i].error
+         );
+      }
+   }
+
+   return g_string_free( summary, FALSE );
+}
+
+/* Numbers */
+
+/* Write number out in E.164 form, so that "(555) 123-4567", "1-555-123-4567" *
+ * and "+1 555 123 4567" all come out as "+15551234567". Ten digits are taken *
+ * as North American, as they are everywhere else in the API. Short codes     *
+ * stay as they are, minus any punctuation. FALSE if it isn't a number.       */
+gboolean voipms_number_canonical(
+   const gchar* number, gchar* out, gsize size
+) {
+   gchar digits[VOIPMS_NUMBER_SIZE];
+   gsize count = 0;
+   gboolean plus = FALSE;
+   const gchar* c;
+
+   for( c = number; '\0' != *c; c++ ) {
+      if( g_ascii_isdigit( *c ) ) {
+         if( sizeof( digits ) - 1 <= count ) {
+            return FALSE;
+         }
+         digits[count++] = *c;
+      } else if( '+' == *c && 0 == count && !plus ) {
+         plus = TRUE;
+      } else if( NULL == strchr( " -.()", *c ) ) {
+         return FALSE;
+      }
+   }
+   digits[count] = '\0';
+   if( 0 == count ) {
+      return FALSE;
+   }
+
+   if( plus ) {
+      return (gsize)g_snprintf( out, size, "+%s", digits ) < size;
+   } else if( 3 < count && !strncmp( digits, "011", 3 ) ) {
+      /* Dialled internationally from North America. */
+      return (gsize)g_snprintf( out, size, "+%s", &(digits[3]) ) < size;
+   } else if( 10 == count ) {
+      return (gsize)g_snprintf( out, size, "+1%s", digits ) < size;
+   } else if( 11 == count && '1' == digits[0] ) {
+      return (gsize)g_snprintf( out, size, "+%s", digits ) < size;
+   }
+
+   return (gsize)g_strlcpy( out, digits, size ) < size;
+}
+
+/* Write number out the way the API wants it: ten digits for North America, *
+ * 011 and the rest for anywhere else. Anything that isn't a number is left *
+ * alone, for the API to reject.                                            */
+gboolean voipms_number_dialable(
+   const gchar* number, gchar* out, gsize size
+) {
+   gchar canonical[VOIPMS_NUMBER_SIZE];
+
+   if( !voipms_number_canonical( number, canonical, sizeof( canonical ) ) ) {
+      return (gsize)g_strlcpy( out, number, size ) < size;
+   }
+
+   if( !strncmp( canonical, "+1", 2 ) && 12 == strlen( canonical ) ) {
+      return (gsize)g_strlcpy( out, &(canonical[2]), size ) < size;
+   } else if( '+' == canonical[0] ) {
+      return (gsize)g_snprintf( out, size, "011%s", &(canonical[1]) ) < size;
+   }
+
+   return (gsize)g_strlcpy( out, canonical, size ) < size;
+}
+
+/* Snapshot */
+
+struct VoipMsSnapshot* voipms_snapshot_new( void ) {
+   struct VoipMsSnapshot* snapshot;
+
+   snapshot = calloc( 1, sizeof( struct VoipMsSnapshot ) );
+   snapshot->dids = g_new0( gchar*, 1 );
+   snapshot->contacts = g_ptr_array_new_with_free_func( g_free );
+
+   return snapshot;
+}
+
+void voipms_snapshot_free( struct VoipMsSnapshot* snapshot ) {
+   g_strfreev( snapshot->dids );
+   g_ptr_array_free( snapshot->contacts, TRUE );
+   free( snapshot );
+}
+
+/* Read a snapshot saved by voipms_snapshot_save(). It's mapped rather than *
+ * read, and the header says how much to expect, so this doesn't scale with *
+ * anything but what's in it. NULL if there isn't one, or it's damaged.     */
+struct VoipMsSnapshot* voipms_snapshot_load( const gchar* path ) {
+   GMappedFile* mapped;
+   const gchar* contents,
+      * string,
+      * end;
+   gsize length;
+   struct VoipMsSnapshotHeader header;
+   struct VoipMsSnapshot* snapshot = NULL;
+   GPtrArray* dids = NULL;
+   guint32 i;
+
+   mapped = g_mapped_file_new( path, FALSE, NULL );
+   if( NULL == mapped ) {
+      return NULL;
+   }
+   contents = g_mapped_file_get_contents( mapped );
+   length = g_mapped_file_get_length( mapped );
+
+   /* Every string has to end before the file does. */
+   if(
+      VOIPMS_SNAPSHOT_MAGIC_SIZE + sizeof( header ) > length ||
+      memcmp( contents, VOIPMS_SNAPSHOT_MAGIC, VOIPMS_SNAPSHOT_MAGIC_SIZE ) ||
+      (VOIPMS_SNAPSHOT_MAGIC_SIZE + sizeof( header ) < length &&
+         '\0' != contents[length - 1])
+   ) {
+      goto snapshot_load_cleanup;
+   }
+   memcpy(
+      &header, &(contents[VOIPMS_SNAPSHOT_MAGIC_SIZE]), sizeof( header )
+   );
+   string = &(contents[VOIPMS_SNAPSHOT_MAGIC_SIZE + sizeof( header )]);
+   end = &(contents[length]);
+
+   snapshot = voipms_snapshot_new();
+   snapshot->high_water = header.high_water;
+   dids = g_ptr_array_new();
+   for( i = 0; header.dids + header.contacts > i; i++ ) {
+      if( end <= string ) {
+         g_warning( "Snapshot %s is cut short; ignoring it.", path );
+         voipms_snapshot_free( snapshot );
+         snapshot = NULL;
+         goto snapshot_load_cleanup;
+      }
+      if( header.dids > i ) {
+         g_ptr_array_add( dids, g_strdup( string ) );
+      } else if( VOIPMS_SNAPSHOT_MAX_CONTACTS > snapshot->contacts->len ) {
+         g_ptr_array_add( snapshot->contacts, g_strdup( string ) );
+      }
+      string += strlen( string ) + 1;
+   }
+   g_ptr_array_add( dids, NULL );
+   g_strfreev( snapshot->dids );
+   snapshot->dids = (gchar**)g_ptr_array_free( dids, FALSE );
+   dids = NULL;
+
+snapshot_load_cleanup:
+
+   if( NULL != dids ) {
+      g_ptr_array_set_free_func( dids, g_free );
+      g_ptr_array_free( dids, TRUE );
+   }
+   g_mapped_file_unref( mapped );
+
+   return snapshot;
+}
+
+/* Replace the snapshot at path in one go, so a crash leaves the old one. */
+gboolean voipms_snapshot_save(
+   const struct VoipMsSnapshot* snapshot, const gchar* path
+) {
+   struct VoipMsSnapshotHeader header = { 0 };
+   GString* contents;
+   guint i;
+   gboolean ok;
+
+   header.high_water = snapshot->high_water;
+   header.dids = g_strv_length( snapshot->dids );
+   header.contacts = snapshot->contacts->len;
+
+   contents = g_string_new_len(
+      VOIPMS_SNAPSHOT_MAGIC, VOIPMS_SNAPSHOT_MAGIC_SIZE
+   );
+   g_string_append_len( contents, (const gchar*)&header, sizeof( header ) );
+   for( i = 0; header.dids > i; i++ ) {
+      g_string_append_len(
+         contents, snapshot->dids[i], strlen( snapshot->dids[i] ) + 1
+      );
+   }
+   for( i = 0; header.contacts > i; i++ ) {
+      g_string_append_len(
+         contents, g_ptr_array_index( snapshot->contacts, i ),
+         strlen( g_ptr_array_index( snapshot->contacts, i ) ) + 1
+      );
+   }
+
+   ok = g_file_set_contents( path, contents->str, contents->len, NULL );
+   if( !ok ) {
+      g_warning( "Unable to write %s.", path );
+   }
+   g_string_free( contents, TRUE );
+
+   return ok;
+}
+
+/* Note a message to or from contact. when is when it was sent, for one   *
+ * that came in, or 0 for one that went out.                              */
+void voipms_snapshot_touch(
+   struct VoipMsSnapshot* snapshot, const gchar* contact, gint64 when
+) {
+   guint i;
+
+   snapshot->high_water = MAX( snapshot->high_water, when );
+
+   /* There are few enough of these that a walk beats keeping an index. */
+   for( i = 0; snapshot->contacts->len > i; i++ ) {
+      if( !strcmp( g_ptr_array_index( snapshot->contacts, i ), contact ) ) {
+         if( 0 == i ) {
+            return;
+         }
+         g_ptr_array_remove_index( snapshot->contacts, i );
+         break;
+      }
+   }
+
+   if( VOIPMS_SNAPSHOT_MAX_CONTACTS <= snapshot->contacts->len ) {
+      g_ptr_array_remove_index(
+         snapshot->contacts, snapshot->contacts->len - 1
+      );
+   }
+   g_ptr_array_insert( snapshot->contacts, 0, g_strdup( contact ) );
+}
+
+/* The SMS-capable DIDs in a getDIDsInfo response. Never NULL. */
+gchar** voipms_api_parse_dids( JsonObject* response ) {
+   JsonNode* node;
+   JsonArray* array;
+   JsonObject* did_json;
+   GPtrArray* dids;
+   const gchar* did,
+      * sms_enabled;
+   guint i;
+
+   dids = g_ptr_array_new();
+
+   node = json_object_get_member( response, "dids" );
+   if( NULL == node || !JSON_NODE_HOLDS_ARRAY( node ) ) {
+      goto parse_dids_cleanup;
+   }
+   array = json_node_get_array( node );
+
+   for( i = 0; json_array_get_length( array ) > i; i++ ) {
+      node = json_array_get_element( array, i );
+      if( !JSON_NODE_HOLDS_OBJECT( node ) ) {
+         continue;
+      }
+      did_json = json_node_get_object( node );
+      did = voipms_json_get_string( did_json, "did" );
+      sms_enabled = voipms_json_get_string( did_json, "sms_enabled" );
+      if( NULL == did || (NULL != sms_enabled && strcmp( sms_enabled, "1" )) ) {
+         continue;
+      }
+      g_ptr_array_add( dids, g_strdup( did ) );
+   }
+
+parse_dids_cleanup:
+
+   g_ptr_array_add( dids, NULL );
+
+   return (gchar**)g_ptr_array_free( dids, FALSE );
+}
+
+/* Flood */
+
+static gint64 voipms_flood_bucket_now( void ) {
+   return
+      g_get_monotonic_time() / G_USEC_PER_SEC / VOIPMS_FLOOD_BUCKET_SECONDS;
+}
+
+/* Empty out the buckets that have gone by since the counter was last used. */
+static void voipms_flood_advance(
+   struct VoipMsFloodCounter* counter, gint64 bucket
+) {
+   if( VOIPMS_FLOOD_BUCKETS <= bucket - counter->bucket ) {
+      memset( counter->counts, '\0', sizeof( counter->counts ) );
+   } else {
+      while( counter->bucket < bucket ) {
+         counter->bucket++;
+         counter->counts[counter->bucket % VOIPMS_FLOOD_BUCKETS] = 0;
+      }
+   }
+   counter->bucket = bucket;
+}
+
+static guint voipms_flood_total( const struct VoipMsFloodCounter* counter ) {
+   guint total = 0;
+   int i;
+
+   for( i = 0; VOIPMS_FLOOD_BUCKETS > i; i++ ) {
+      total += counter->counts[i];
+   }
+
+   return total;
+}
+
+static void voipms_flood_count( struct VoipMsFloodCounter* counter ) {
+   guint16* count = &(counter->counts[counter->bucket % VOIPMS_FLOOD_BUCKETS]);
+
+   if( G_MAXUINT16 > *count ) {
+      (*count)++;
+   }
+}
+
+struct VoipMsFlood* voipms_flood_new( guint per_contact, guint per_account ) {
+   struct VoipMsFlood* flood;
+
+   flood = calloc( 1, sizeof( struct VoipMsFlood ) );
+   flood->per_contact = per_contact;
+   flood->per_account = per_account;
+   flood->account.bucket = voipms_flood_bucket_now();
+   flood->contacts =
+      g_hash_table_new_full( g_str_hash, g_str_equal, g_free, free );
+
+   return flood;
+}
+
+void voipms_flood_free( struct VoipMsFlood* flood ) {
+   g_hash_table_destroy( flood->contacts );
+   free( flood );
+}
+
+/* Whether a message from contact can be shown now. Only messages that are  *
+ * shown count against the limits, so a contact that keeps on flooding     *
+ * still gets per_contact messages through a minute.                        */
+gboolean voipms_flood_admit( struct VoipMsFlood* flood, const gchar* contact ) {
+   struct VoipMsFloodCounter* counter;
+   gint64 bucket = voipms_flood_bucket_now();
+
+   counter = g_hash_table_lookup( flood->contacts, contact );
+   if( NULL == counter ) {
+      counter = calloc( 1, sizeof( struct VoipMsFloodCounter ) );
+      counter->bucket = bucket;
+      g_hash_table_insert( flood->contacts, g_strdup( contact ), counter );
+   }
+
+   voipms_flood_advance( counter, bucket );
+   voipms_flood_advance( &(flood->account), bucket );
+
+   if(
+      (0 < flood->per_contact &&
+         flood->per_contact <= voipms_flood_total( counter )) ||
+      (0 < flood->per_account &&
+         flood->per_account <= voipms_flood_total( &(flood->account) ))
+   ) {
+      return FALSE;
+   }
+
+   voipms_flood_count( counter );
+   voipms_flood_count( &(flood->account) );
+
+   return TRUE;
+}
+
+static gboolean voipms_flood_is_quiet(
+   gpointer key, gpointer value, gpointer user_data
+) {
+   struct VoipMsFloodCounter* counter = (struct VoipMsFloodCounter*)value;
+
+   voipms_flood_advance( counter, *(gint64*)user_data );
+   return 0 == voipms_flood_total( counter );
+}
+
+/* Forget contacts that haven't sent anything for a whole minute. */
+void voipms_flood_prune( struct VoipMsFlood* flood ) {
+   gint64 bucket = voipms_flood_bucket_now();
+
+   g_hash_table_foreach_remove(
+      flood->contacts, voipms_flood_is_quiet, &bucket
+   );
+}
+
+/* Capture */
+
+gboolean voipms_capture_open( struct VoipMsSession* session, const gchar* path ) {
+   session->capture = g_fopen( path, "wb" );
+   if(
+      NULL == session->capture ||
+      1 != fwrite(
+         VOIPMS_CAPTURE_MAGIC, VOIPMS_CAPTURE_MAGIC_SIZE, 1, session->capture
+      )
+   ) {
+      g_warning( "Unable to open %s.", path );
+      voipms_capture_close( session );
+      return FALSE;
+   }
+
+   g_debug( "Capturing API traffic to %s.", path );
+   session->capture_started = g_get_monotonic_time();
+   return TRUE;
+}
+
+void voipms_capture_close( struct VoipMsSession* session ) {
+   if( NULL != session->capture ) {
+      fclose( session->capture );
+      session->capture = NULL;
+   }
+}
+
+/* Keep what we sent, minus anything that would let a capture log in. Binary *
+ * data is left out too; only its size matters for replaying a response.     */
+static void voipms_capture_args(
+   struct RequestMemoryStruct* capture_args, GSList* args
+) {
+   GSList* arg_iter;
+   struct VoipMsApiArg* arg;
+
+   for( arg_iter = args; NULL != arg_iter; arg_iter = g_slist_next( arg_iter ) ) {
+      arg = (struct VoipMsApiArg*)arg_iter->data;
+      if(
+         !strcmp( "api_username", arg->key ) ||
+         !strcmp( "api_password", arg->key )
+      ) {
+         continue;
+      }
+      if( 0 < capture_args->size ) {
+         voipms_buffer_append( capture_args, "&", 1 );
+      }
+      voipms_buffer_append( capture_args, arg->key, strlen( arg->key ) );
+      voipms_buffer_append( capture_args, "=", 1 );
+      if( NULL == arg->data ) {
+         voipms_form_encode_append(
+            capture_args, arg->value, strlen( arg->value )
+         );
+      }
+   }
+}
+
+static void voipms_capture_write(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data,
+   CURLcode result
+) {
+   struct VoipMsCaptureRecord record = { 0 };
+   char* body = request_data->chunk.memory,
+      * found;
+   size_t password_length;
+   gint64 now;
+
+   if( NULL == session->capture ) {
+      return;
+   }
+
+   now = g_get_monotonic_time();
+   record.started = request_data->started - session->capture_started;
+   record.latency = now - request_data->started;
+   record.method = request_data->method;
+   record.result = result;
+   record.args_size = request_data->capture_args.size;
+   record.body_size = request_data->chunk.size;
+
+   /* Responses shouldn't ever echo the password back, but mask it in the    *
+    * captured copy if one does.                                             */
+   password_length =
+      NULL == session->password ? 0 : strlen( session->password );
+   if(
+      0 < password_length && NULL != memmem(
+         body, record.body_size, session->password, password_length
+      )
+   ) {
+      body = g_memdup( body, record.body_size );
+      /* Carry on past each mask, or a password of '*'s is found forever. */
+      found = body;
+      while(
+         NULL != (found = memmem(
+            found, record.body_size - (found - body),
+            session->password, password_length
+         ))
+      ) {
+         memset( found, '*', password_length );
+         found += password_length;
+      }
+   }
+
+   if(
+      1 != fwrite( &record, sizeof( record ), 1, session->capture ) ||
+      record.args_size != fwrite(
+         request_data->capture_args.memory, 1, record.args_size,
+         session->capture
+      ) ||
+      record.body_size !=
+         fwrite( body, 1, record.body_size, session->capture )
+   ) {
+      g_warning( "Unable to write capture; stopping." );
+      voipms_capture_close( session );
+   }
+
+   if( body != request_data->chunk.memory ) {
+      g_free( body );
+   }
+}
+
+/* Read the record at *offset in a capture that's been loaded whole, and     *
+ * move past it. Returns FALSE at the end, or if the record is cut short.    */
+gboolean voipms_capture_read(
+   const gchar* contents, gsize length, gsize* offset,
+   struct VoipMsCaptureRecord* record, const gchar** body
+) {
+   if(
+      *offset >= length ||
+      sizeof( struct VoipMsCaptureRecord ) > length - *offset
+   ) {
+      return FALSE;
+   }
+   memcpy( record, &(contents[*offset]), sizeof( struct VoipMsCaptureRecord ) );
+   if(
+      (gsize)record->args_size + record->body_size >
+         length - *offset - sizeof( struct VoipMsCaptureRecord )
+   ) {
+      return FALSE;
+   }
+
+   *body = &(contents[
+      *offset + sizeof( struct VoipMsCaptureRecord ) + record->args_size
+   ]);
+   *offset +=
+      sizeof( struct VoipMsCaptureRecord ) + record->args_size + record->body_size;
+
+   return TRUE;
+}
+
+/* A finished request as it was captured, ready for the complete callback. */
+struct VoipMsRequestData* voipms_request_data_new_replay(
+   const struct VoipMsCaptureRecord* record, const gchar* body
+) {
+   struct VoipMsRequestData* request_data;
+
+   request_data = calloc( 1, sizeof( struct VoipMsRequestData ) );
+   request_data->method = record->method;
+   request_data->replayed = TRUE;
+   request_data->error_buffer = calloc( CURL_ERROR_SIZE, sizeof( char ) );
+   request_data->chunk.memory = calloc( record->body_size + 1, sizeof( char ) );
+   request_data->chunk.size = record->body_size;
+   request_data->chunk.capacity = record->body_size + 1;
+   memcpy( request_data->chunk.memory, body, record->body_size );
+
+   return request_data;
+}
+
+/* Flight recorder */
+
+static const gchar* voipms_method_names[] = {
+   "sendSMS",
+   "getSMS",
+   "deleteSMS",
+   "sendMMS",
+   "getMMS",
+   "deleteMMS",
+   "media",
+   "getDIDsInfo"
+};
+
+static const gchar* voipms_trace_type_names[] = {
+   "poll",
+   "start",
+   "finish",
+   "status",
+   "invalid",
+   "received",
+   "held",
+   "sent"
+};
+
+/* API statuses worth telling apart afterwards. 0 is anything else. */
+static const gchar* voipms_trace_statuses[] = {
+   "other",
+   "success",
+   "no_sms",
+   "invalid_credentials",
+   "missing_credentials",
+   "ip_not_enabled",
+   "api_not_enabled",
+   "limit_reached",
+   "invalid_did",
+   "missing_did",
+   "invalid_date",
+   "invalid_dst",
+   "invalid_message",
+   "message_empty",
+   "missing_dst",
+   "missing_message",
+   "sms_toolong",
+   "sms_failed",
+   "mms_failed",
+   NULL
+};
+
+const gchar* voipms_method_name( guint8 method ) {
+   if( G_N_ELEMENTS( voipms_method_names ) <= method ) {
+      return "unknown";
+   }
+   return voipms_method_names[method];
+}
+
+const gchar* voipms_trace_type_name( guint8 type ) {
+   if( G_N_ELEMENTS( voipms_trace_type_names ) <= type ) {
+      return "unknown";
+   }
+   return voipms_trace_type_names[type];
+}
+
+guint16 voipms_trace_status_code( const gchar* status ) {
+   guint16 i;
+
+   for( i = 1; NULL != voipms_trace_statuses[i]; i++ ) {
+      if( !strcmp( status, voipms_trace_statuses[i] ) ) {
+         return i;
+      }
+   }
+
+   return 0;
+}
+
+const gchar* voipms_trace_status_name( guint16 code ) {
+   if( G_N_ELEMENTS( voipms_trace_statuses ) - 1 <= code ) {
+      return voipms_trace_statuses[0];
+   }
+   return voipms_trace_statuses[code];
+}
+
+/* Record an event. This is always on, so it takes a slot with one atomic   *
+ * add and fills it in place; nothing is formatted or allocated. A slot's   *
+ * sequence is only set once the rest is written, so a reader can tell a    *
+ * torn slot from a whole one without any lock.                             */
+void voipms_trace(
+   VOIPMS_TRACE type, VOIPMS_METHOD method, guint32 request, guint16 status,
+   guint32 bytes, guint32 latency, guint32 detail
+) {
+   guint index = (guint)g_atomic_int_add( &voipms_trace_head, 1 );
+   struct VoipMsTraceEvent* event =
+      &(voipms_trace_ring[index & (VOIPMS_TRACE_EVENTS - 1)]);
+
+   g_atomic_int_set( &(event->sequence), 0 );
+   event->time = g_get_monotonic_time();
+   event->request = request;
+   event->bytes = bytes;
+   event->latency = latency;
+   event->detail = detail;
+   event->type = type;
+   event->method = method;
+   event->status = status;
+   g_atomic_int_set( &(event->sequence), (gint)(index + 1) );
+}
+
+/* Copy out what's in the recorder, oldest first, skipping any slot that's  *
+ * being written as we go. events must have room for VOIPMS_TRACE_EVENTS.   */
+gsize voipms_trace_snapshot( struct VoipMsTraceEvent* events ) {
+   guint head = (guint)g_atomic_int_get( &voipms_trace_head ),
+      index;
+   struct VoipMsTraceEvent* event;
+   gsize count = 0;
+   gint sequence;
+
+   index = VOIPMS_TRACE_EVENTS < head ? head - VOIPMS_TRACE_EVENTS : 0;
+   for( ; head != index; index++ ) {
+      event = &(voipms_trace_ring[index & (VOIPMS_TRACE_EVENTS - 1)]);
+      sequence = g_atomic_int_get( &(event->sequence) );
+      if( (gint)(index + 1) != sequence ) {
+         continue;
+      }
+      events[count] = *event;
+      if( g_atomic_int_get( &(event->sequence) ) != sequence ) {
+         continue;
+      }
+      count++;
+   }
+
+   return count;
+}
+
+/* Write the recorder out as VOIPMS_TRACE_MAGIC and then its events, for   *
+ * voipms-trace to read.                                                   */
+gboolean voipms_trace_dump( const gchar* path ) {
+   struct VoipMsTraceEvent* events;
+   gsize count;
+   FILE* file;
+   gboolean ok = FALSE;
+
+   events = g_new( struct VoipMsTraceEvent, VOIPMS_TRACE_EVENTS );
+   count = voipms_trace_snapshot( events );
+
+   file = g_fopen( path, "wb" );
+   if( NULL == file ) {
+      g_warning( "Unable to open %s.", path );
+      goto trace_dump_cleanup;
+   }
+
+   ok =
+      1 == fwrite( VOIPMS_TRACE_MAGIC, VOIPMS_TRACE_MAGIC_SIZE, 1, file ) &&
+      count == fwrite( events, sizeof( struct VoipMsTraceEvent ), count, file );
+   if( 0 != fclose( file ) || !ok ) {
+      g_warning( "Unable to write %s.", path );
+      ok = FALSE;
+   }
+
+trace_dump_cleanup:
+
+   g_free( events );
+
+   return ok;
+}
+
+/* Relay */
+
+/* One socket per user, next to everything else that only lasts a login. */
+gchar* voipms_relay_default_path( void ) {
+   return g_build_filename(
+      g_get_user_runtime_dir(), "voipms-relay.sock", NULL
+   );
+}
+
+/* Pull whatever's waiting on a non-blocking socket into in. Returns the     *
+ * number of bytes read, 0 if there was nothing yet, or -1 if the other end  *
+ * is gone or sent more than we'll hold.                                     */
+int voipms_relay_read( int fd, GString* in ) {
+   char buffer[4096];
+   ssize_t read_size;
+   int total = 0;
+
+   for( ;; ) {
+      read_size = read( fd, buffer, sizeof( buffer ) );
+      if( 0 < read_size ) {
+         g_string_append_len( in, buffer, read_size );
+         total += read_size;
+         if( VOIPMS_RELAY_MAX_LINE < in->len ) {
+            return -1;
+         }
+      } else if( 0 == read_size ) {
+         return -1;
+      } else if( EINTR == errno ) {
+         continue;
+      } else if( EAGAIN == errno || EWOULDBLOCK == errno ) {
+         return total;
+      } else {
+         return -1;
+      }
+   }
+}
+
+/* Write as much of out as the socket will take. FALSE if it's gone. */
+gboolean voipms_relay_write( int fd, GString* out ) {
+   ssize_t written;
+
+   while( 0 < out->len ) {
+      written = send( fd, out->str, out->len, MSG_NOSIGNAL );
+      if( 0 < written ) {
+         g_string_erase( out, 0, written );
+      } else if( 0 > written && EINTR == errno ) {
+         continue;
+      } else if(
+         0 > written && (EAGAIN == errno || EWOULDBLOCK == errno)
+      ) {
+         return TRUE;
+      } else {
+         return FALSE;
+      }
+   }
+
+   return TRUE;
+}
+
+/* Take the next whole line off in, or NULL if there isn't one yet. */
+gchar* voipms_relay_next_line( GString* in ) {
+   char* newline;
+   gchar* line;
+
+   newline = memchr( in->str, '\n', in->len );
+   if( NULL == newline ) {
+      return NULL;
+   }
+
+   line = g_strndup( in->str, newline - in->str );
+   g_string_erase( in, 0, newline - in->str + 1 );
+
+   return line;
+}
+
+/* Queue what the builder built as one line. JSON never needs a raw newline, *
+ * so lines can't run together.                                              */
+void voipms_relay_append( GString* out, JsonBuilder* builder ) {
+   JsonGenerator* generator;
+   JsonNode* root;
+   gchar* line;
+   gsize length;
+
+   root = json_builder_get_root( builder );
+   generator = json_generator_new();
+   json_generator_set_root( generator, root );
+   line = json_generator_to_data( generator, &length );
+   g_string_append_len( out, line, length );
+   g_string_append_c( out, '\n' );
+
+   g_free( line );
+   g_object_unref( generator );
+   json_node_free( root );
+}
+
+static gboolean voipms_relay_connect( struct VoipMsSession* session ) {
+   struct sockaddr_un address = { 0 };
+   int fd;
+
+   if( strlen( session->relay_path ) >= sizeof( address.sun_path ) ) {
+      g_warning( "Relay socket path is too long: %s", session->relay_path );
+      return FALSE;
+   }
+   address.sun_family = AF_UNIX;
+   strcpy( address.sun_path, session->relay_path );
+
+   fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+   if( 0 > fd ) {
+      return FALSE;
+   }
+   if( 0 > connect( fd, (struct sockaddr*)&address, sizeof( address ) ) ) {
+      g_debug(
+         "Unable to reach relay at %s: %s",
+         session->relay_path, g_strerror( errno )
+      );
+      close( fd );
+      return FALSE;
+   }
+   fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+
+   g_debug( "Connected to relay at %s.", session->relay_path );
+   session->relay_fd = fd;
+   return TRUE;
+}
+
+/* Reconnect if we've lost the relay, but don't hammer one that isn't there. */
+static gboolean voipms_relay_ensure( struct VoipMsSession* session ) {
+   if( 0 <= session->relay_fd ) {
+      return TRUE;
+   }
+   if( time( NULL ) < session->relay_retry_after ) {
+      return FALSE;
+   }
+   if( !voipms_relay_connect( session ) ) {
+      session->relay_retry_after = time( NULL ) + VOIPMS_RELAY_RETRY_SECONDS;
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/* Drop the connection. Whatever was waiting on it either fails, so its owner *
+ * can retry, or is cancelled if the session is going away.                   */
+static void voipms_relay_close(
+   struct VoipMsSession* session, gboolean cancel
+) {
+   GHashTableIter iter;
+   gpointer request_data;
+   GList* waiting = NULL,
+      * waiting_iter;
+
+   if( 0 <= session->relay_fd ) {
+      close( session->relay_fd );
+      session->relay_fd = -1;
+   }
+   g_string_truncate( session->relay_in, 0 );
+   g_string_truncate( session->relay_out, 0 );
+   session->relay_retry_after = time( NULL ) + VOIPMS_RELAY_RETRY_SECONDS;
+
+   /* Empty the table first; complete callbacks may queue new requests. */
+   g_hash_table_iter_init( &iter, session->relay_requests );
+   while( g_hash_table_iter_next( &iter, NULL, &request_data ) ) {
+      waiting = g_list_prepend( waiting, request_data );
+      g_hash_table_iter_remove( &iter );
+   }
+
+   for(
+      waiting_iter = waiting;
+      NULL != waiting_iter;
+      waiting_iter = g_list_next( waiting_iter )
+   ) {
+      if( cancel ) {
+         voipms_request_cancel( session, waiting_iter->data );
+         voipms_request_data_free( waiting_iter->data );
+      } else {
+         g_strlcpy(
+            ((struct VoipMsRequestData*)waiting_iter->data)->error_buffer,
+            "relay unavailable", CURL_ERROR_SIZE
+         );
+         voipms_request_complete(
+            session, waiting_iter->data, CURLE_COULDNT_CONNECT
+         );
+      }
+   }
+   g_list_free( waiting );
+}
+
+void voipms_relay_open( struct VoipMsSession* session, const gchar* path ) {
+   session->relay_path = g_strdup( path );
+   session->relay_in = g_string_new( NULL );
+   session->relay_out = g_string_new( NULL );
+   session->relay_requests = g_hash_table_new_full(
+      g_int64_hash, g_int64_equal, g_free, NULL
+   );
+
+   voipms_relay_connect( session );
+}
+
+static void voipms_relay_request(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data,
+   GSList* args
+) {
+   JsonBuilder* builder;
+   GSList* arg_iter;
+   struct VoipMsApiArg* arg;
+   gchar* encoded,
+      * value;
+   gint64* tag;
+
+   request_data->relayed = TRUE;
+   request_data->started = g_get_monotonic_time();
+   voipms_trace(
+      VOIPMS_TRACE_START, request_data->method, request_data->trace_id,
+      0, 0, 0, 0
+   );
+
+   if( !voipms_relay_ensure( session ) ) {
+      /* Going around the relay would bring the delete races right back. */
+      g_strlcpy(
+         request_data->error_buffer, "relay unavailable", CURL_ERROR_SIZE
+      );
+      voipms_request_complete(
+         session, request_data, CURLE_COULDNT_CONNECT
+      );
+      g_slist_free_full( args, voipms_api_args_free );
+      return;
+   }
+
+   builder = json_builder_new();
+   json_builder_begin_object( builder );
+   json_builder_set_member_name( builder, "op" );
+   json_builder_add_string_value( builder, "request" );
+   json_builder_set_member_name( builder, "tag" );
+   json_builder_add_int_value( builder, session->relay_next_tag );
+   json_builder_set_member_name( builder, "method" );
+   json_builder_add_int_value( builder, request_data->method );
+   json_builder_set_member_name( builder, "args" );
+   json_builder_begin_object( builder );
+   for( arg_iter = args; NULL != arg_iter; arg_iter = g_slist_next( arg_iter ) ) {
+      arg = (struct VoipMsApiArg*)arg_iter->data;
+      json_builder_set_member_name( builder, arg->key );
+      if( NULL == arg->data ) {
+         json_builder_add_string_value( builder, arg->value );
+      } else {
+         encoded = g_base64_encode( arg->data, arg->data_size );
+         value = g_strdup_printf( "data:%s;base64,%s", arg->mime, encoded );
+         json_builder_add_string_value( builder, value );
+         g_free( value );
+         g_free( encoded );
+      }
+   }
+   json_builder_end_object( builder );
+   json_builder_end_object( builder );
+
+   voipms_relay_append( session->relay_out, builder );
+   g_object_unref( builder );
+   g_slist_free_full( args, voipms_api_args_free );
+
+   tag = g_new( gint64, 1 );
+   *tag = session->relay_next_tag++;
+   g_hash_table_insert( session->relay_requests, tag, request_data );
+}
+
+/* A response to one of our requests, or messages the relay polled for. */
+static void voipms_relay_handle_line(
+   struct VoipMsSession* session, const gchar* line
+) {
+   JsonParser* parser;
+   JsonObject* object;
+   const gchar* op,
+      * body,
+      * error;
+   struct VoipMsRequestData* request_data = NULL;
+   gint64 tag;
+   CURLcode result = CURLE_OK;
+
+   parser = json_parser_new();
+   object = voipms_api_parse_response( parser, line, strlen( line ) );
+   if( NULL == object ) {
+      /* The line can hold messages, so only its size goes in the logs. */
+      g_warning(
+         "Relay sent a %" G_GSIZE_FORMAT " byte line we can't read.",
+         strlen( line )
+      );
+      goto relay_handle_line_cleanup;
+   }
+   op = voipms_json_get_string( object, "op" );
+   body = voipms_json_get_string( object, "body" );
+   if( NULL == op || NULL == body ) {
+      goto relay_handle_line_cleanup;
+   }
+
+   if( !strcmp( op, "response" ) ) {
+      if( !json_object_has_member( object, "tag" ) ) {
+         goto relay_handle_line_cleanup;
+      }
+      tag = json_object_get_int_member( object, "tag" );
+      request_data = g_hash_table_lookup( session->relay_requests, &tag );
+      if( NULL == request_data ) {
+         goto relay_handle_line_cleanup;
+      }
+      /* Frees the tag; the request is ours again to complete. */
+      g_hash_table_remove( session->relay_requests, &tag );
+      if( json_object_has_member( object, "result" ) ) {
+         result = (CURLcode)json_object_get_int_member( object, "result" );
+      }
+      error = voipms_json_get_string( object, "error" );
+      if( NULL != error ) {
+         g_strlcpy( request_data->error_buffer, error, CURL_ERROR_SIZE );
+      }
+
+   } else if( !strcmp( op, "messages" ) ) {
+      if( !json_object_has_member( object, "method" ) ) {
+         goto relay_handle_line_cleanup;
+      }
+      request_data = calloc( 1, sizeof( struct VoipMsRequestData ) );
+      request_data->method = json_object_get_int_member( object, "method" );
+      request_data->relayed = TRUE;
+      request_data->error_buffer = calloc( CURL_ERROR_SIZE, sizeof( char ) );
+      request_data->chunk.memory = calloc( 1, sizeof( char ) );
+      request_data->chunk.capacity = 1;
+
+   } else {
+      goto relay_handle_line_cleanup;
+   }
+
+   if( !voipms_buffer_append( &(request_data->chunk), body, strlen( body ) ) ) {
+      result = CURLE_OUT_OF_MEMORY;
+   }
+   voipms_request_complete( session, request_data, result );
+
+relay_handle_line_cleanup:
+
+   g_object_unref( parser );
+}
+
+static void voipms_relay_progress( struct VoipMsSession* session ) {
+   gchar* line;
+
+   if( !voipms_relay_ensure( session ) ) {
+      return;
+   }
+
+   if(
+      !voipms_relay_write( session->relay_fd, session->relay_out ) ||
+      0 > voipms_relay_read( session->relay_fd, session->relay_in )
+   ) {
+      g_warning( "Lost the relay at %s.", session->relay_path );
+      voipms_relay_close( session, FALSE );
+      return;
+   }
+
+   while( NULL != (line = voipms_relay_next_line( session->relay_in )) ) {
+      voipms_relay_handle_line( session, line );
+      g_free( line );
+   }
+}
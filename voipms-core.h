@@ -0,0 +1,435 @@
+
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The request engine, response parser, poll scheduler and outbox store.     *
+ * Nothing in here knows about libpurple, so voipms.so and voipms-cli can    *
+ * both sit on top of it. Front ends get their finished requests back        *
+ * through the session's complete callback.                                  */
+
+#ifndef VOIPMS_CORE_H
+#define VOIPMS_CORE_H
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+#include <curl/curl.h>
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+
+#define VOIPMS_API_URL "https://voip.ms/api/v1/rest.php"
+
+#define VOIPMS_ERROR_SIZE CURL_ERROR_SIZE + 255
+#define VOIPMS_DATE_BUFFER_SIZE 20
+#define VOIPMS_MAX_AGE_DAYS 91
+#define VOIPMS_DAY_SECONDS (60 * 60 * 24)
+#define VOIPMS_POLL_SECONDS 1
+#define VOIPMS_BUFFER_MIN_SIZE 256
+#define VOIPMS_MMS_MAX_MEDIA 3
+#define VOIPMS_BASE64_CHUNK_SIZE 3072 /* Must be a multiple of 3. */
+#define VOIPMS_OUTBOX_MAX_IN_FLIGHT 8
+#define VOIPMS_OUTBOX_RETRY_SECONDS 30
+#define VOIPMS_CAPTURE_MAGIC "VMSCAP01"
+#define VOIPMS_CAPTURE_MAGIC_SIZE 8
+#define VOIPMS_RELAY_RETRY_SECONDS 5
+#define VOIPMS_RELAY_MAX_LINE (64 * 1024 * 1024)
+#define VOIPMS_BUDGET_BURST_SECONDS 60 /* How much budget can pile up. */
+#define VOIPMS_BUDGET_MAX_DELAY 600
+#define VOIPMS_BULK_DEFAULT_CONCURRENCY 8
+#define VOIPMS_BULK_MAX_CONCURRENCY 32
+#define VOIPMS_BULK_DEFAULT_RATE 10 /* Sends per second. */
+#define VOIPMS_TRACE_EVENTS 4096 /* Must be a power of 2. */
+#define VOIPMS_TRACE_MAGIC "VMSTRC01"
+#define VOIPMS_TRACE_MAGIC_SIZE 8
+#define VOIPMS_NUMBER_SIZE 20 /* E.164 is at most 15 digits, plus '+'. */
+#define VOIPMS_SNAPSHOT_MAGIC "VMSSNP01"
+#define VOIPMS_SNAPSHOT_MAGIC_SIZE 8
+#define VOIPMS_SNAPSHOT_MAX_CONTACTS 64
+#define VOIPMS_FLOOD_BUCKETS 6
+#define VOIPMS_FLOOD_BUCKET_SECONDS 10 /* So limits are over the last minute. */
+
+typedef enum {
+   VOIPMS_METHOD_SENDSMS,
+   VOIPMS_METHOD_GETSMS,
+   VOIPMS_METHOD_DELETESMS,
+   VOIPMS_METHOD_SENDMMS,
+   VOIPMS_METHOD_GETMMS,
+   VOIPMS_METHOD_DELETEMMS,
+   VOIPMS_METHOD_MEDIA, /* Attachment download; not an API call. */
+   VOIPMS_METHOD_GETDIDSINFO /* After MEDIA so old captures still read. */
+} VOIPMS_METHOD;
+
+/* What happened, for the flight recorder. See struct VoipMsTraceEvent. */
+typedef enum {
+   VOIPMS_TRACE_POLL,
+   VOIPMS_TRACE_START,
+   VOIPMS_TRACE_FINISH, /* status is the CURLcode. */
+   VOIPMS_TRACE_STATUS, /* status is from voipms_trace_status_code(). */
+   VOIPMS_TRACE_BAD_RESPONSE,
+   VOIPMS_TRACE_RECEIVED,
+   VOIPMS_TRACE_HELD, /* Received, but over the flood limits. */
+   VOIPMS_TRACE_SENT
+} VOIPMS_TRACE;
+
+typedef enum {
+   VOIPMS_BULK_PENDING,
+   VOIPMS_BULK_IN_FLIGHT,
+   VOIPMS_BULK_SENT,
+   VOIPMS_BULK_FAILED
+} VOIPMS_BULK_STATUS;
+
+typedef enum {
+   VOIPMS_OUTBOX_UNREACHABLE, /* Keep it and try again later. */
+   VOIPMS_OUTBOX_SENT,
+   VOIPMS_OUTBOX_REJECTED /* The API won't ever take this one. */
+} VOIPMS_OUTBOX_RESULT;
+
+struct VoipMsSession;
+struct VoipMsRequestData;
+struct VoipMsBulk;
+
+typedef void (*VoipMsCompleteFunc)(
+   struct VoipMsSession*, struct VoipMsRequestData*, CURLcode
+);
+typedef void (*VoipMsCancelFunc)(
+   struct VoipMsSession*, struct VoipMsRequestData*
+);
+typedef void (*VoipMsBulkFunc)( struct VoipMsSession*, struct VoipMsBulk* );
+
+struct RequestMemoryStruct {
+   char* memory;
+   size_t size;
+   size_t capacity;
+};
+
+struct VoipMsApiArg {
+   gchar* key;
+   gchar* value; /* Raw, unencoded value. */
+   const guchar* data; /* Sent as a base64 data URI instead of value. */
+   gsize data_size;
+   gchar* mime;
+   gpointer data_owner; /* Released with data_owner_free once sent. */
+   GDestroyNotify data_owner_free;
+};
+
+struct VoipMsOutboxEntry {
+   gchar* cid; /* Client-side ID, so replays of the file don't duplicate. */
+   gchar* dst;
+   gchar* message;
+   gboolean in_flight;
+};
+
+struct VoipMsOutbox {
+   gchar* path;
+   FILE* file; /* Append-only log of queued (+) and finished (-) sends. */
+   gboolean dirty; /* Written to since the last fsync. */
+   GQueue entries; /* Pending sends, oldest first. */
+   GHashTable* ids; /* cid to struct VoipMsOutboxEntry. */
+   GHashTable* busy; /* Recipients with a send in flight. */
+   guint in_flight;
+   guint next_id;
+   time_t retry_after;
+};
+
+struct VoipMsTraffic {
+   guint64 requests;
+   guint64 sent; /* Request lines, headers and bodies. */
+   guint64 received; /* Headers and bodies, still compressed. */
+   guint64 decoded; /* Bodies as they reached us, decompressed. */
+};
+
+struct VoipMsBulkRecipient {
+   gchar* dst;
+   VOIPMS_BULK_STATUS status;
+   gchar* error; /* Why it failed, if it did. */
+};
+
+/* One message to many recipients, sent outside the outbox so it can go out *
+ * as fast as the caps allow and report back on every recipient.            */
+struct VoipMsBulk {
+   gchar* message;
+   struct VoipMsBulkRecipient* recipients;
+   guint count;
+   guint next; /* First recipient not yet sent to. */
+   guint in_flight;
+   guint sent;
+   guint failed;
+   guint concurrency;
+   gdouble rate; /* Sends per second. */
+   gdouble tokens;
+   gint64 refilled;
+   gboolean pumping; /* Sends that fail straight away mustn't recurse. */
+   VoipMsBulkFunc progress; /* After every recipient; freed after the last. */
+   gpointer user_data;
+   GDestroyNotify user_data_free;
+};
+
+/* One slot in the flight recorder. Only sizes, codes and IDs go in here,   *
+ * never message text, so it's cheap to fill and safe to hand over.         */
+struct VoipMsTraceEvent {
+   gint64 time; /* Monotonic microseconds. */
+   gint sequence; /* Which event this is, plus one; 0 while it's written. */
+   guint32 request; /* Numbered from 1 as requests are made; 0 for none. */
+   guint32 bytes;
+   guint32 latency; /* Microseconds, for VOIPMS_TRACE_FINISH. */
+   guint32 detail; /* Message ID received, or attachments sent. */
+   guint8 type;
+   guint8 method;
+   guint16 status;
+};
+
+/* What an account knew when it last closed, so the next login can start  *
+ * from there instead of from nothing.                                     */
+struct VoipMsSnapshot {
+   gchar** dids; /* SMS-capable DIDs, as of the last getDIDsInfo. */
+   gint64 high_water; /* When the newest message seen was sent; 0 if none. */
+   GPtrArray* contacts; /* Most recent first. */
+};
+
+/* The file is VOIPMS_SNAPSHOT_MAGIC, then this, then the DIDs and then the *
+ * contacts, each NUL-terminated.                                          */
+struct VoipMsSnapshotHeader {
+   gint64 high_water;
+   guint32 dids;
+   guint32 contacts;
+};
+
+/* Messages counted in each of the last few buckets, newest at bucket. */
+struct VoipMsFloodCounter {
+   gint64 bucket; /* Bucket-lengths since the monotonic clock started. */
+   guint16 counts[VOIPMS_FLOOD_BUCKETS];
+};
+
+struct VoipMsFlood {
+   guint per_contact; /* Messages a minute from any one contact; 0 for any. */
+   guint per_account; /* Messages a minute from everyone; 0 for any. */
+   struct VoipMsFloodCounter account;
+   GHashTable* contacts; /* Contact to struct VoipMsFloodCounter. */
+};
+
+/* A capture file is VOIPMS_CAPTURE_MAGIC followed by one of these per        *
+ * finished request, each trailed by its arguments and then its response.   *
+ * Fields are in host byte order.                                            */
+struct VoipMsCaptureRecord {
+   gint64 started; /* Microseconds after the capture was opened. */
+   gint64 latency; /* Microseconds from start to completion. */
+   guint32 method;
+   gint32 result; /* CURLcode. */
+   guint32 args_size; /* Form-encoded, without the credentials. */
+   guint32 body_size;
+};
+
+struct VoipMsSession {
+   gchar* username;
+   gchar* password;
+   gchar* api_url;
+   gchar* did; /* Polls only ask about this one; blank for them all. */
+   gchar* send_did; /* Messages go out from this one. */
+   gboolean use_post;
+   CURLM* multi_handle;
+   int still_running;
+   GHashTable* requests; /* CURL* to struct VoipMsRequestData in flight. */
+   guint polls_in_flight;
+   time_t poll_since; /* Newest message already seen, to narrow polls. */
+   struct RequestMemoryStruct form_buffer; /* Reused for each request. */
+   struct VoipMsOutbox outbox;
+   struct VoipMsTraffic traffic; /* Everything this session has moved. */
+   guint64 budget; /* Bytes per hour polls should stay under, or 0. */
+   gdouble budget_tokens; /* Bytes that can be spent before polls wait. */
+   gint64 budget_refilled;
+   GList* bulks; /* struct VoipMsBulk still running. */
+   FILE* capture; /* Finished requests are recorded here, if enabled. */
+   gint64 capture_started;
+   gchar* relay_path; /* If set, the relay at this socket owns the API. */
+   int relay_fd;
+   GString* relay_in;
+   GString* relay_out;
+   GHashTable* relay_requests; /* Tag to struct VoipMsRequestData. */
+   gint64 relay_next_tag;
+   time_t relay_retry_after;
+   VoipMsCompleteFunc complete; /* Every request comes back through here. */
+   VoipMsCancelFunc cancel; /* Or here, if the session goes first. */
+   gpointer user_data;
+};
+
+struct VoipMsMessage {
+   gchar* id;
+   gchar* contact;
+   gchar* message;
+   struct tm timeinfo;
+   gboolean outgoing;
+   gboolean mms;
+   GList* media; /* Attachment URLs, for MMS. */
+   gpointer account; /* Whatever the front end parsed it for. */
+};
+
+struct VoipMsRequestData {
+   VOIPMS_METHOD method;
+   char* error_buffer;
+   struct RequestMemoryStruct chunk;
+   void* attachment;
+   gint64 started;
+   struct RequestMemoryStruct capture_args; /* Only kept while capturing. */
+   gboolean replayed; /* Read back from a capture, not sent anywhere. */
+   gboolean relayed; /* Answered by the relay, which owns deletion. */
+   VoipMsCompleteFunc complete; /* The core's own, instead of the session's. */
+   guint32 trace_id; /* What the flight recorder calls it. */
+};
+
+struct GcFuncDataMessageList {
+   GList* messages;
+   gpointer account;
+   gboolean mms;
+   gboolean replayed; /* Show the messages, but don't touch the server. */
+   gboolean relayed; /* Show and download, but leave deleting to the relay. */
+};
+
+/* Encoding */
+
+gboolean voipms_buffer_reserve( struct RequestMemoryStruct*, size_t );
+gboolean voipms_buffer_append(
+   struct RequestMemoryStruct*, const char*, size_t
+);
+gboolean voipms_form_encode_append(
+   struct RequestMemoryStruct*, const char*, size_t
+);
+GSList* voipms_api_args_add( GSList*, const gchar*, const gchar* );
+GSList* voipms_api_args_add_data(
+   GSList*, const gchar*, const gchar*, const guchar*, gsize, gpointer,
+   GDestroyNotify
+);
+void voipms_api_args_free( gpointer );
+gboolean voipms_api_build_form(
+   struct RequestMemoryStruct*, GSList*, const char*
+);
+
+/* Requests */
+
+struct VoipMsSession* voipms_session_new(
+   const gchar*, const gchar*, const gchar*, const gchar*, gboolean
+);
+void voipms_session_free( struct VoipMsSession* );
+gboolean voipms_session_poll( struct VoipMsSession*, gboolean );
+void voipms_session_set_budget( struct VoipMsSession*, guint64 );
+guint voipms_session_poll_delay( struct VoipMsSession* );
+size_t voipms_api_request_write_body_callback( void*, size_t, size_t, void* );
+struct VoipMsRequestData* voipms_request_data_new(
+   struct VoipMsSession*, VOIPMS_METHOD, void*
+);
+void voipms_request_data_free( struct VoipMsRequestData* );
+gboolean voipms_request_is_poll( const struct VoipMsRequestData* );
+void voipms_request_start(
+   struct VoipMsSession*, CURL*, struct VoipMsRequestData*
+);
+void voipms_api_request(
+   struct VoipMsSession*, VOIPMS_METHOD, GSList*, void*
+);
+void voipms_api_request_progress( struct VoipMsSession* );
+
+/* Responses */
+
+const gchar* voipms_json_get_string( JsonObject*, const gchar* );
+gboolean voipms_parse_date( const gchar*, struct tm* );
+JsonObject* voipms_api_parse_response( JsonParser*, const char*, size_t );
+void voipms_api_parse_messages( JsonObject*, struct GcFuncDataMessageList* );
+const gchar* voipms_api_request_status(
+   struct VoipMsRequestData*, CURLcode, JsonParser*, JsonObject**
+);
+void voipms_message_free( gpointer );
+
+/* Outbox */
+
+gboolean voipms_outbox_status_is_final( const gchar* );
+void voipms_outbox_open( struct VoipMsSession*, const gchar* );
+void voipms_outbox_close( struct VoipMsSession* );
+gboolean voipms_outbox_add(
+   struct VoipMsSession*, const gchar*, const gchar*
+);
+void voipms_outbox_sync( struct VoipMsSession* );
+void voipms_outbox_pump( struct VoipMsSession* );
+void voipms_outbox_done(
+   struct VoipMsSession*, struct VoipMsOutboxEntry*, VOIPMS_OUTBOX_RESULT
+);
+
+/* Capture */
+
+gboolean voipms_capture_open( struct VoipMsSession*, const gchar* );
+void voipms_capture_close( struct VoipMsSession* );
+gboolean voipms_capture_read(
+   const gchar*, gsize, gsize*, struct VoipMsCaptureRecord*, const gchar**
+);
+struct VoipMsRequestData* voipms_request_data_new_replay(
+   const struct VoipMsCaptureRecord*, const gchar*
+);
+
+/* Bulk */
+
+void voipms_bulk_start(
+   struct VoipMsSession*, gchar**, const gchar*, guint, guint,
+   VoipMsBulkFunc, gpointer, GDestroyNotify
+);
+gboolean voipms_bulk_is_done( const struct VoipMsBulk* );
+gchar* voipms_bulk_summary( const struct VoipMsBulk* );
+
+/* Numbers */
+
+gboolean voipms_number_canonical( const gchar*, gchar*, gsize );
+gboolean voipms_number_dialable( const gchar*, gchar*, gsize );
+
+/* Snapshot */
+
+struct VoipMsSnapshot* voipms_snapshot_new( void );
+void voipms_snapshot_free( struct VoipMsSnapshot* );
+struct VoipMsSnapshot* voipms_snapshot_load( const gchar* );
+gboolean voipms_snapshot_save( const struct VoipMsSnapshot*, const gchar* );
+void voipms_snapshot_touch( struct VoipMsSnapshot*, const gchar*, gint64 );
+gchar** voipms_api_parse_dids( JsonObject* );
+
+/* Flood */
+
+struct VoipMsFlood* voipms_flood_new( guint, guint );
+void voipms_flood_free( struct VoipMsFlood* );
+gboolean voipms_flood_admit( struct VoipMsFlood*, const gchar* );
+void voipms_flood_prune( struct VoipMsFlood* );
+
+/* Flight recorder */
+
+void voipms_trace(
+   VOIPMS_TRACE, VOIPMS_METHOD, guint32, guint16, guint32, guint32, guint32
+);
+guint16 voipms_trace_status_code( const gchar* );
+const gchar* voipms_trace_status_name( guint16 );
+const gchar* voipms_trace_type_name( guint8 );
+const gchar* voipms_method_name( guint8 );
+gsize voipms_trace_snapshot( struct VoipMsTraceEvent* );
+gboolean voipms_trace_dump( const gchar* );
+
+/* Relay */
+
+void voipms_relay_open( struct VoipMsSession*, const gchar* );
+gchar* voipms_relay_default_path( void );
+int voipms_relay_read( int, GString* );
+gboolean voipms_relay_write( int, GString* );
+gchar* voipms_relay_next_line( GString* );
+void voipms_relay_append( GString*, JsonBuilder* );
+
+#endif /* VOIPMS_CORE_H */
+
@@ -0,0 +1,78 @@
+
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* libFuzzer harness for the response parser, or the date parser when built *
+ * with VOIPMS_FUZZ_DATE. Build with VOIPMS_FUZZ_STDIN to get a main() that *
+ * reads one input from stdin, for AFL and for replaying crashes.            */
+
+#include "voipms-core.h"
+
+#include <stdint.h>
+
+int LLVMFuzzerTestOneInput( const uint8_t* data, size_t size ) {
+#ifdef VOIPMS_FUZZ_DATE
+   gchar* date;
+   struct tm timeinfo;
+
+   date = g_strndup( (const gchar*)data, size );
+   voipms_parse_date( date, &timeinfo );
+   g_free( date );
+#else
+   struct GcFuncDataMessageList message_list =
+      { NULL, NULL, FALSE, FALSE, FALSE };
+   JsonParser* parser;
+   JsonObject* response;
+
+   if( 0 == size ) {
+      return 0;
+   }
+
+   /* Let the first byte pick between getSMS and getMMS handling. */
+   message_list.mms = data[0] & 1;
+
+   parser = json_parser_new();
+   response = voipms_api_parse_response(
+      parser, (const char*)&(data[1]), size - 1
+   );
+   if( NULL != response ) {
+      voipms_json_get_string( response, "status" );
+      voipms_api_parse_messages( response, &message_list );
+   }
+   g_list_free_full( message_list.messages, voipms_message_free );
+   g_object_unref( parser );
+#endif /* VOIPMS_FUZZ_DATE */
+
+   return 0;
+}
+
+#ifdef VOIPMS_FUZZ_STDIN
+int main( int argc, char** argv ) {
+   GString* input;
+   char buffer[4096];
+   size_t read_size;
+
+   input = g_string_new( NULL );
+   while( 0 < (read_size = fread( buffer, 1, sizeof( buffer ), stdin )) ) {
+      g_string_append_len( input, buffer, read_size );
+   }
+
+   LLVMFuzzerTestOneInput( (const uint8_t*)input->str, input->len );
+   g_string_free( input, TRUE );
+
+   return 0;
+}
+#endif /* VOIPMS_FUZZ_STDIN */
+
@@ -0,0 +1,672 @@
+
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Owns one API session on behalf of any number of local clients. It polls  *
+ * while anyone's connected, passes new messages on to all of them, deletes *
+ * them once, and sends whatever requests the clients hand it. Clients talk *
+ * to it over a UNIX socket, one JSON object per line:                      *
+ *                                                                          *
+ *   -> {"op":"request","tag":N,"method":M,"args":{...}}                    *
+ *   <- {"op":"response","tag":N,"result":R,"error":"...","body":"..."}     *
+ *   <- {"op":"messages","method":M,"body":"..."}                           *
+ *                                                                          *
+ * where M is a VOIPMS_METHOD, R is a CURLcode and body is the API's JSON.  */
+
+#include "voipms-core.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define VOIPMS_RELAY_WAIT_MS 1000
+#define VOIPMS_RELAY_MAX_CLIENTS 64
+#define VOIPMS_RELAY_MMS_HOLD_SECONDS 300
+
+struct VoipMsRelayClient {
+   guint id;
+   int fd;
+   GString* in;
+   GString* out;
+};
+
+/* Who to answer once a client's request comes back. The client may be gone *
+ * by then, so it's looked up by ID rather than held onto.                  */
+struct VoipMsRelayPending {
+   guint client_id;
+   gint64 tag;
+};
+
+/* MMS attachments are fetched by each client from the URLs in the message, *
+ * so give them a while before the message goes.                            */
+struct VoipMsRelayHeld {
+   gchar* id;
+   time_t due;
+};
+
+struct VoipMsRelay {
+   struct VoipMsSession* session;
+   int listen_fd;
+   GHashTable* clients; /* ID to struct VoipMsRelayClient. */
+   guint next_client_id;
+   GHashTable* seen_sms; /* IDs in the last getSMS, already passed on. */
+   GHashTable* seen_mms;
+   GQueue held; /* struct VoipMsRelayHeld, due soonest first. */
+   gboolean delete_;
+   gboolean mms;
+};
+
+static volatile sig_atomic_t _voipms_relay_interrupted = 0;
+
+static gchar* _voipms_relay_username = NULL;
+static gchar* _voipms_relay_password = NULL;
+static gchar* _voipms_relay_did = NULL;
+static gchar* _voipms_relay_api_url = NULL;
+static gchar* _voipms_relay_socket = NULL;
+static gboolean _voipms_relay_get = FALSE;
+static gint _voipms_relay_budget = 0;
+static gboolean _voipms_relay_mms = FALSE;
+static gboolean _voipms_relay_keep = FALSE;
+static gboolean _voipms_relay_verbose = FALSE;
+
+static GOptionEntry _voipms_relay_options[] = {
+   { "username", 'u', 0, G_OPTION_ARG_STRING, &_voipms_relay_username,
+      "VOIP.ms account e-mail address", "EMAIL" },
+   { "password", 'p', 0, G_OPTION_ARG_STRING, &_voipms_relay_password,
+      "API password (default: $VOIPMS_API_PASSWORD)", "PASSWORD" },
+   { "did", 'd', 0, G_OPTION_ARG_STRING, &_voipms_relay_did,
+      "DID to send from and receive for", "NUMBER" },
+   { "api-url", 0, 0, G_OPTION_ARG_STRING, &_voipms_relay_api_url,
+      "API URL (default: " VOIPMS_API_URL ")", "URL" },
+   { "socket", 's', 0, G_OPTION_ARG_STRING, &_voipms_relay_socket,
+      "Socket to listen on (default: $XDG_RUNTIME_DIR/voipms-relay.sock)",
+      "PATH" },
+   { "budget", 'b', 0, G_OPTION_ARG_INT, &_voipms_relay_budget,
+      "Stretch the poll interval to stay under KB per hour", "KB" },
+   { "get", 0, 0, G_OPTION_ARG_NONE, &_voipms_relay_get,
+      "Send requests as GET query strings instead of POST bodies", NULL },
+   { "mms", 'm', 0, G_OPTION_ARG_NONE, &_voipms_relay_mms,
+      "Also poll for picture messages", NULL },
+   { "keep", 'k', 0, G_OPTION_ARG_NONE, &_voipms_relay_keep,
+      "Leave messages on the server once they're passed on", NULL },
+   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &_voipms_relay_verbose,
+      "Log requests to stderr", NULL },
+   { NULL }
+};
+
+static void voipms_relay_interrupt( int signum ) {
+   _voipms_relay_interrupted = 1;
+}
+
+static void voipms_relay_log_handler(
+   const gchar* log_domain, GLogLevelFlags log_level, const gchar* message,
+   gpointer user_data
+) {
+   if(
+      _voipms_relay_verbose ||
+      log_level &
+         (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING)
+   ) {
+      fprintf( stderr, "%s\n", message );
+   }
+}
+
+static void voipms_relay_client_free( gpointer data ) {
+   struct VoipMsRelayClient* client = (struct VoipMsRelayClient*)data;
+
+   close( client->fd );
+   g_string_free( client->in, TRUE );
+   g_string_free( client->out, TRUE );
+   free( client );
+}
+
+static void voipms_relay_held_free( gpointer data ) {
+   struct VoipMsRelayHeld* held = (struct VoipMsRelayHeld*)data;
+
+   g_free( held->id );
+   free( held );
+}
+
+static int voipms_relay_listen( const gchar* path ) {
+   struct sockaddr_un address = { 0 };
+   int fd;
+
+   if( strlen( path ) >= sizeof( address.sun_path ) ) {
+      g_warning( "Socket path is too long: %s", path );
+      return -1;
+   }
+   address.sun_family = AF_UNIX;
+   strcpy( address.sun_path, path );
+
+   fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+   if( 0 > fd ) {
+      return -1;
+   }
+
+   /* Clear out a socket left behind by a relay that didn't get to clean up. */
+   g_unlink( path );
+   if(
+      0 > bind( fd, (struct sockaddr*)&address, sizeof( address ) ) ||
+      0 > chmod( path, 0600 ) ||
+      0 > listen( fd, SOMAXCONN )
+   ) {
+      g_warning( "Unable to listen on %s: %s", path, g_strerror( errno ) );
+      close( fd );
+      return -1;
+   }
+   fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+
+   return fd;
+}
+
+static void voipms_relay_accept( struct VoipMsRelay* relay ) {
+   struct VoipMsRelayClient* client;
+   int fd;
+
+   while( 0 <= (fd = accept( relay->listen_fd, NULL, NULL )) ) {
+      if( VOIPMS_RELAY_MAX_CLIENTS <= g_hash_table_size( relay->clients ) ) {
+         g_warning( "Too many clients; turning one away." );
+         close( fd );
+         continue;
+      }
+      fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+
+      client = calloc( 1, sizeof( struct VoipMsRelayClient ) );
+      client->id = ++relay->next_client_id;
+      client->fd = fd;
+      client->in = g_string_new( NULL );
+      client->out = g_string_new( NULL );
+      g_hash_table_insert(
+         relay->clients, GUINT_TO_POINTER( client->id ), client
+      );
+      g_debug( "Client %u connected.", client->id );
+   }
+}
+
+/* Send a request from a client on to the API, on the relay's credentials. */
+static void voipms_relay_client_request(
+   struct VoipMsRelay* relay, struct VoipMsRelayClient* client,
+   JsonObject* object
+) {
+   struct VoipMsRelayPending* pending;
+   JsonObject* args_object;
+   JsonNode* args_node;
+   GList* members,
+      * member_iter;
+   GSList* args = NULL;
+   gint64 method;
+   const gchar* value;
+
+   if(
+      !json_object_has_member( object, "method" ) ||
+      !json_object_has_member( object, "tag" )
+   ) {
+      return;
+   }
+
+   method = json_object_get_int_member( object, "method" );
+   if(
+      0 > method || VOIPMS_METHOD_GETDIDSINFO < method ||
+      VOIPMS_METHOD_MEDIA == method
+   ) {
+      /* Attachments are for the clients to fetch themselves. */
+      return;
+   }
+
+   args_node = json_object_get_member( object, "args" );
+   if( NULL != args_node && JSON_NODE_HOLDS_OBJECT( args_node ) ) {
+      args_object = json_node_get_object( args_node );
+      members = json_object_get_members( args_object );
+      for(
+         member_iter = members;
+         NULL != member_iter;
+         member_iter = g_list_next( member_iter )
+      ) {
+         value = voipms_json_get_string( args_object, member_iter->data );
+         if(
+            NULL == value ||
+            !strcmp( "api_username", member_iter->data ) ||
+            !strcmp( "api_password", member_iter->data ) ||
+            !strcmp( "method", member_iter->data )
+         ) {
+            continue;
+         }
+         args = voipms_api_args_add( args, member_iter->data, value );
+      }
+      g_list_free( members );
+   }
+
+   pending = calloc( 1, sizeof( struct VoipMsRelayPending ) );
+   pending->client_id = client->id;
+   pending->tag = json_object_get_int_member( object, "tag" );
+
+   voipms_api_request( relay->session, method, args, pending );
+}
+
+/* Returns FALSE if the client's gone or talking nonsense. */
+static gboolean voipms_relay_client_progress(
+   struct VoipMsRelay* relay, struct VoipMsRelayClient* client
+) {
+   JsonParser* parser;
+   JsonObject* object;
+   const gchar* op;
+   gchar* line;
+   gboolean ok = TRUE;
+
+   if( 0 > voipms_relay_read( client->fd, client->in ) ) {
+      return FALSE;
+   }
+
+   parser = json_parser_new();
+   while( ok && NULL != (line = voipms_relay_next_line( client->in )) ) {
+      object = voipms_api_parse_response( parser, line, strlen( line ) );
+      op = NULL == object ? NULL : voipms_json_get_string( object, "op" );
+      if( NULL != op && !strcmp( op, "request" ) ) {
+         voipms_relay_client_request( relay, client, object );
+      } else {
+         g_warning( "Client %u sent something we can't read.", client->id );
+         ok = FALSE;
+      }
+      g_free( line );
+   }
+   g_object_unref( parser );
+
+   return ok;
+}
+
+static void voipms_relay_broadcast(
+   struct VoipMsRelay* relay, VOIPMS_METHOD method, const gchar* body
+) {
+   JsonBuilder* builder;
+   GHashTableIter iter;
+   gpointer client;
+   GString* line;
+
+   builder = json_builder_new();
+   json_builder_begin_object( builder );
+   json_builder_set_member_name( builder, "op" );
+   json_builder_add_string_value( builder, "messages" );
+   json_builder_set_member_name( builder, "method" );
+   json_builder_add_int_value( builder, method );
+   json_builder_set_member_name( builder, "body" );
+   json_builder_add_string_value( builder, body );
+   json_builder_end_object( builder );
+
+   /* Encode it once, however many clients there are. */
+   line = g_string_new( NULL );
+   voipms_relay_append( line, builder );
+   g_object_unref( builder );
+
+   g_hash_table_iter_init( &iter, relay->clients );
+   while( g_hash_table_iter_next( &iter, NULL, &client ) ) {
+      g_string_append_len(
+         ((struct VoipMsRelayClient*)client)->out, line->str, line->len
+      );
+   }
+   g_string_free( line, TRUE );
+}
+
+/* Pass on whatever's new in a poll, then get rid of it on the server. */
+static void voipms_relay_poll_done(
+   struct VoipMsRelay* relay, VOIPMS_METHOD method, JsonObject* response
+) {
+   GHashTable** seen = VOIPMS_METHOD_GETMMS == method ?
+      &(relay->seen_mms) : &(relay->seen_sms);
+   GHashTable* now_seen;
+   JsonNode* sms;
+   JsonArray* fresh,
+      * messages;
+   JsonObject* message,
+      * filtered;
+   JsonNode* root;
+   JsonGenerator* generator;
+   struct VoipMsRelayHeld* held;
+   const gchar* id;
+   gchar* body;
+   GSList* api_args;
+   guint i;
+
+   now_seen = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, NULL );
+   fresh = json_array_new();
+
+   sms = json_object_get_member( response, "sms" );
+   messages = NULL != sms && JSON_NODE_HOLDS_ARRAY( sms ) ?
+      json_node_get_array( sms ) : NULL;
+   for(
+      i = 0;
+      NULL != messages && i < json_array_get_length( messages );
+      i++
+   ) {
+      if( !JSON_NODE_HOLDS_OBJECT( json_array_get_element( messages, i ) ) ) {
+         continue;
+      }
+      message = json_array_get_object_element( messages, i );
+      id = voipms_json_get_string( message, "id" );
+      if( NULL == id ) {
+         continue;
+      }
+
+      /* Only remember what's still on the server, so this can't grow       *
+       * forever, and a message that's deleted out from under us is dropped. */
+      g_hash_table_add( now_seen, g_strdup( id ) );
+      if( g_hash_table_contains( *seen, id ) ) {
+         continue;
+      }
+      json_array_add_element(
+         fresh, json_node_copy( json_array_get_element( messages, i ) )
+      );
+
+      if( !relay->delete_ ) {
+         continue;
+      }
+      if( VOIPMS_METHOD_GETMMS == method ) {
+         held = calloc( 1, sizeof( struct VoipMsRelayHeld ) );
+         held->id = g_strdup( id );
+         held->due = time( NULL ) + VOIPMS_RELAY_MMS_HOLD_SECONDS;
+         g_queue_push_tail( &(relay->held), held );
+      } else {
+         api_args = voipms_api_args_add( NULL, "id", id );
+         voipms_api_request(
+            relay->session, VOIPMS_METHOD_DELETESMS, api_args, NULL
+         );
+      }
+   }
+
+   g_hash_table_destroy( *seen );
+   *seen = now_seen;
+
+   if( 0 == json_array_get_length( fresh ) ) {
+      json_array_unref( fresh );
+      return;
+   }
+
+   /* Hand the clients a getSMS response with only the new messages in it,   *
+    * so they can parse it the same way they would the API's.                */
+   filtered = json_object_new();
+   json_object_set_string_member( filtered, "status", "success" );
+   json_object_set_array_member( filtered, "sms", fresh );
+   root = json_node_new( JSON_NODE_OBJECT );
+   json_node_take_object( root, filtered );
+   generator = json_generator_new();
+   json_generator_set_root( generator, root );
+   body = json_generator_to_data( generator, NULL );
+
+   g_debug( "Passing on %u new message(s).", json_array_get_length( fresh ) );
+   voipms_relay_broadcast( relay, method, body );
+
+   g_free( body );
+   g_object_unref( generator );
+   json_node_free( root );
+}
+
+static void voipms_relay_complete(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data,
+   CURLcode result
+) {
+   struct VoipMsRelay* relay = (struct VoipMsRelay*)session->user_data;
+   struct VoipMsRelayPending* pending =
+      (struct VoipMsRelayPending*)request_data->attachment;
+   struct VoipMsRelayClient* client;
+   JsonBuilder* builder;
+   JsonParser* parser;
+   JsonObject* response;
+   const gchar* status;
+
+   if( NULL != pending ) {
+      /* A client asked for this, so it gets the response as it came. */
+      client = g_hash_table_lookup(
+         relay->clients, GUINT_TO_POINTER( pending->client_id )
+      );
+      if( NULL != client ) {
+         builder = json_builder_new();
+         json_builder_begin_object( builder );
+         json_builder_set_member_name( builder, "op" );
+         json_builder_add_string_value( builder, "response" );
+         json_builder_set_member_name( builder, "tag" );
+         json_builder_add_int_value( builder, pending->tag );
+         json_builder_set_member_name( builder, "result" );
+         json_builder_add_int_value( builder, result );
+         json_builder_set_member_name( builder, "error" );
+         json_builder_add_string_value( builder, request_data->error_buffer );
+         json_builder_set_member_name( builder, "body" );
+         json_builder_add_string_value( builder, request_data->chunk.memory );
+         json_builder_end_object( builder );
+         voipms_relay_append( client->out, builder );
+         g_object_unref( builder );
+      }
+      free( pending );
+      return;
+   }
+
+   parser = json_parser_new();
+   status = voipms_api_request_status( request_data, result, parser, &response );
+   switch( request_data->method ) {
+      case VOIPMS_METHOD_GETSMS:
+      case VOIPMS_METHOD_GETMMS:
+         if( NULL != response && !strcmp( status, "success" ) ) {
+            voipms_relay_poll_done( relay, request_data->method, response );
+         } else if( NULL != response && !strcmp( status, "no_sms" ) ) {
+            g_hash_table_remove_all(
+               VOIPMS_METHOD_GETMMS == request_data->method ?
+                  relay->seen_mms : relay->seen_sms
+            );
+         }
+         break;
+
+      default:
+         if( strcmp( status, "success" ) ) {
+            g_warning( "Unable to delete message: %s", status );
+         }
+         break;
+   }
+   g_object_unref( parser );
+}
+
+static void voipms_relay_cancel(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data
+) {
+   free( request_data->attachment );
+}
+
+static void voipms_relay_run( struct VoipMsRelay* relay ) {
+   struct curl_waitfd* wait_fds = NULL;
+   struct VoipMsRelayClient* client;
+   struct VoipMsRelayHeld* held;
+   GHashTableIter iter;
+   gpointer value;
+   GSList* api_args;
+   time_t next_poll = 0;
+   guint wait_count,
+      i;
+
+   while( !_voipms_relay_interrupted ) {
+      /* Nobody to pass messages on to means nobody to delete them for. */
+      if(
+         0 < g_hash_table_size( relay->clients ) && time( NULL ) >= next_poll
+      ) {
+         voipms_session_poll( relay->session, relay->mms );
+         next_poll = time( NULL ) + VOIPMS_POLL_SECONDS;
+      }
+
+      /* Wait on the clients and the API together. */
+      wait_count = 1 + g_hash_table_size( relay->clients );
+      wait_fds = g_renew( struct curl_waitfd, wait_fds, wait_count );
+      wait_fds[0].fd = relay->listen_fd;
+      wait_fds[0].events = CURL_WAIT_POLLIN;
+      wait_fds[0].revents = 0;
+      i = 1;
+      g_hash_table_iter_init( &iter, relay->clients );
+      while( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+         client = (struct VoipMsRelayClient*)value;
+         wait_fds[i].fd = client->fd;
+         wait_fds[i].events = CURL_WAIT_POLLIN |
+            (0 < client->out->len ? CURL_WAIT_POLLOUT : 0);
+         wait_fds[i].revents = 0;
+         i++;
+      }
+      curl_multi_wait(
+         relay->session->multi_handle, wait_fds, wait_count,
+         VOIPMS_RELAY_WAIT_MS, NULL
+      );
+
+      if( wait_fds[0].revents ) {
+         voipms_relay_accept( relay );
+      }
+
+      g_hash_table_iter_init( &iter, relay->clients );
+      while( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+         client = (struct VoipMsRelayClient*)value;
+         if( !voipms_relay_client_progress( relay, client ) ) {
+            g_debug( "Client %u disconnected.", client->id );
+            g_hash_table_iter_remove( &iter );
+         }
+      }
+
+      voipms_api_request_progress( relay->session );
+
+      while(
+         NULL != (held = g_queue_peek_head( &(relay->held) )) &&
+         time( NULL ) >= held->due
+      ) {
+         g_queue_pop_head( &(relay->held) );
+         api_args = voipms_api_args_add( NULL, "id", held->id );
+         voipms_api_request(
+            relay->session, VOIPMS_METHOD_DELETEMMS, api_args, NULL
+         );
+         voipms_relay_held_free( held );
+      }
+
+      /* Responses went into the clients' buffers above; send them now. */
+      g_hash_table_iter_init( &iter, relay->clients );
+      while( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+         client = (struct VoipMsRelayClient*)value;
+         if( !voipms_relay_write( client->fd, client->out ) ) {
+            g_debug( "Client %u disconnected.", client->id );
+            g_hash_table_iter_remove( &iter );
+         }
+      }
+   }
+
+   g_free( wait_fds );
+}
+
+int main( int argc, char** argv ) {
+   GOptionContext* context;
+   GError* error = NULL;
+   struct VoipMsRelay relay = { 0 };
+   const gchar* password;
+   gchar* socket_path = NULL;
+   gpointer held;
+   int exit_status = EXIT_SUCCESS;
+
+   relay.listen_fd = -1;
+
+   context = g_option_context_new( NULL );
+   g_option_context_set_summary(
+      context,
+      "Poll VOIP.ms once for any number of local clients, and pass their "
+      "requests on."
+   );
+   g_option_context_add_main_entries( context, _voipms_relay_options, NULL );
+   if( !g_option_context_parse( context, &argc, &argv, &error ) ) {
+      fprintf( stderr, "%s\n", error->message );
+      g_error_free( error );
+      exit_status = EXIT_FAILURE;
+      goto main_cleanup;
+   }
+
+   password = NULL != _voipms_relay_password ?
+      _voipms_relay_password : g_getenv( "VOIPMS_API_PASSWORD" );
+   if(
+      NULL == _voipms_relay_username || NULL == password ||
+      NULL == _voipms_relay_did
+   ) {
+      fprintf( stderr, "A username, API password and DID are required.\n" );
+      exit_status = EXIT_FAILURE;
+      goto main_cleanup;
+   }
+
+   g_log_set_handler(
+      "voipms", G_LOG_LEVEL_MASK, voipms_relay_log_handler, NULL
+   );
+   signal( SIGINT, voipms_relay_interrupt );
+   signal( SIGTERM, voipms_relay_interrupt );
+   signal( SIGPIPE, SIG_IGN );
+
+   socket_path = NULL != _voipms_relay_socket ?
+      g_strdup( _voipms_relay_socket ) : voipms_relay_default_path();
+   relay.listen_fd = voipms_relay_listen( socket_path );
+   if( 0 > relay.listen_fd ) {
+      exit_status = EXIT_FAILURE;
+      goto main_cleanup;
+   }
+
+   curl_global_init( CURL_GLOBAL_ALL );
+
+   relay.session = voipms_session_new(
+      _voipms_relay_username,
+      password,
+      NULL != _voipms_relay_api_url ? _voipms_relay_api_url : VOIPMS_API_URL,
+      _voipms_relay_did,
+      !_voipms_relay_get
+   );
+   relay.session->complete = voipms_relay_complete;
+   relay.session->cancel = voipms_relay_cancel;
+   relay.session->user_data = &relay;
+   if( 0 < _voipms_relay_budget ) {
+      voipms_session_set_budget(
+         relay.session, (guint64)_voipms_relay_budget * 1024
+      );
+   }
+   relay.clients = g_hash_table_new_full(
+      g_direct_hash, g_direct_equal, NULL, voipms_relay_client_free
+   );
+   relay.seen_sms =
+      g_hash_table_new_full( g_str_hash, g_str_equal, g_free, NULL );
+   relay.seen_mms =
+      g_hash_table_new_full( g_str_hash, g_str_equal, g_free, NULL );
+   g_queue_init( &(relay.held) );
+   relay.delete_ = !_voipms_relay_keep;
+   relay.mms = _voipms_relay_mms;
+
+   g_debug( "Listening on %s.", socket_path );
+   voipms_relay_run( &relay );
+
+main_cleanup:
+
+   if( NULL != relay.session ) {
+      /* Held MMS stay on the server; the next relay will pass them on. */
+      while( NULL != (held = g_queue_pop_head( &(relay.held) )) ) {
+         voipms_relay_held_free( held );
+      }
+      g_hash_table_destroy( relay.clients );
+      voipms_session_free( relay.session );
+      g_hash_table_destroy( relay.seen_sms );
+      g_hash_table_destroy( relay.seen_mms );
+      curl_global_cleanup();
+   }
+   if( 0 <= relay.listen_fd ) {
+      close( relay.listen_fd );
+      g_unlink( socket_path );
+   }
+   g_free( socket_path );
+   g_option_context_free( context );
+
+   return exit_status;
+}
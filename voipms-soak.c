@@ -0,0 +1,538 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Sign an account in and out thousands of times through libpurple, against *
+ * a stand-in API on loopback, and fail if memory keeps growing. Each cycle  *
+ * receives SMS and an MMS, sends a message and opens a conversation, then    *
+ * signs off with whatever's left still in flight. The plugin's functions    *
+ * are all static, so we pull the source in whole.                           */
+
+#include "voipms.c"
+#include "eventloop.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define SOAK_UI "voipms-soak"
+#define SOAK_DEFAULT_CYCLES 3000
+#define SOAK_WARMUP_CYCLES 100 /* Let one-time setup settle before measuring. */
+#define SOAK_CYCLE_TIMEOUT_US (5 * G_USEC_PER_SEC)
+#define SOAK_TICK_US 1000 /* Stands in for the plugin's one-second timer. */
+#define SOAK_REQUEST_MAX 65536
+#define SOAK_MAX_ALLOCATIONS 256 /* Still live after warm up, for slack. */
+#define SOAK_MAX_RSS_KIB 4096 /* Peak RSS growth after warm up. */
+#define SOAK_CONTACT "5557654321"
+
+#define SOAK_READ_COND (G_IO_IN | G_IO_HUP | G_IO_ERR)
+#define SOAK_WRITE_COND (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+/* Track live allocations by sitting in front of glibc's allocator, like    *
+ * voipms-bench does, but counting frees too. The responder thread calls     *
+ * these as well, so the count is atomic.                                    */
+extern void* __libc_malloc( size_t );
+extern void* __libc_calloc( size_t, size_t );
+extern void* __libc_realloc( void*, size_t );
+extern void* __libc_memalign( size_t, size_t );
+extern void __libc_free( void* );
+
+static gint soak_live = 0;
+
+void* malloc( size_t size ) {
+   void* ptr = __libc_malloc( size );
+
+   if( NULL != ptr ) {
+      g_atomic_int_inc( &soak_live );
+   }
+   return ptr;
+}
+
+void* calloc( size_t nmemb, size_t size ) {
+   void* ptr = __libc_calloc( nmemb, size );
+
+   if( NULL != ptr ) {
+      g_atomic_int_inc( &soak_live );
+   }
+   return ptr;
+}
+
+void* realloc( void* ptr, size_t size ) {
+   void* moved = __libc_realloc( ptr, size );
+
+   if( NULL == ptr && NULL != moved ) {
+      g_atomic_int_inc( &soak_live );
+   } else if( NULL != ptr && 0 == size ) {
+      /* glibc frees it and hands back NULL. */
+      g_atomic_int_add( &soak_live, -1 );
+   }
+   return moved;
+}
+
+int posix_memalign( void** memptr, size_t alignment, size_t size ) {
+   *memptr = __libc_memalign( alignment, size );
+   if( NULL == *memptr ) {
+      return ENOMEM;
+   }
+   g_atomic_int_inc( &soak_live );
+   return 0;
+}
+
+void* memalign( size_t alignment, size_t size ) {
+   void* ptr = __libc_memalign( alignment, size );
+
+   if( NULL != ptr ) {
+      g_atomic_int_inc( &soak_live );
+   }
+   return ptr;
+}
+
+void* aligned_alloc( size_t alignment, size_t size ) {
+   void* ptr = __libc_memalign( alignment, size );
+
+   if( NULL != ptr ) {
+      g_atomic_int_inc( &soak_live );
+   }
+   return ptr;
+}
+
+void free( void* ptr ) {
+   if( NULL != ptr ) {
+      g_atomic_int_add( &soak_live, -1 );
+   }
+   __libc_free( ptr );
+}
+
+/* Set at the start of each cycle, and taken by the first poll to answer. */
+static gint soak_fresh_sms = 0;
+static gint soak_fresh_mms = 0;
+
+/* Counted by the responder, and reset at the start of each cycle. */
+static gint soak_sends = 0;
+static gint soak_downloads = 0;
+
+static guint soak_received = 0;
+static guint16 soak_port = 0;
+
+/* The stand-in API: one request per connection, answered straight away.  *
+ * It only uses the stack, so it doesn't move the allocation count.         */
+static gpointer soak_responder( gpointer data ) {
+   int listen_fd = GPOINTER_TO_INT( data ),
+      client_fd;
+   char request[SOAK_REQUEST_MAX + 1],
+      header[256],
+      mms[512];
+   const char* body,
+      * length_header,
+      * content_type;
+   ssize_t got;
+   size_t size,
+      wanted;
+   int header_size;
+
+   while( 0 <= (client_fd = accept( listen_fd, NULL, NULL )) ) {
+      /* Read the headers, then as much body as they say there is. */
+      size = 0;
+      wanted = 0;
+      request[0] = '\0';
+      while( SOAK_REQUEST_MAX > size ) {
+         got = recv( client_fd, &(request[size]), SOAK_REQUEST_MAX - size, 0 );
+         if( 0 >= got ) {
+            break;
+         }
+         size += got;
+         request[size] = '\0';
+         if( 0 == wanted && NULL != (body = strstr( request, "\r\n\r\n" )) ) {
+            body += 4;
+            wanted = body - request;
+            length_header = strcasestr( request, "\r\nContent-Length:" );
+            if( NULL != length_header && body > length_header ) {
+               wanted += strtoul( length_header + 17, NULL, 10 );
+            }
+         }
+         if( 0 < wanted && size >= wanted ) {
+            break;
+         }
+      }
+
+      /* GET has the method in the query string, POST in the body. The    *
+       * messages only go to the first poll of a cycle, so they aren't     *
+       * shown over and over.                                              */
+      content_type = "application/json";
+      if( !strncmp( request, "GET /media/", 11 ) ) {
+         g_atomic_int_inc( &soak_downloads );
+         content_type = "image/png";
+         body = "\x89PNG\r\n\x1a\n soak";
+      } else if( NULL != strstr( request, "method=getSMS" ) ) {
+         body = g_atomic_int_compare_and_exchange( &soak_fresh_sms, 1, 0 ) ?
+            "{\"status\":\"success\",\"sms\":["
+            "{\"id\":\"3\",\"date\":\"2016-03-01 10:00:02\",\"type\":\"1\","
+            "\"did\":\"5551234567\",\"contact\":\"" SOAK_CONTACT "\","
+            "\"message\":\"Third\"},"
+            "{\"id\":\"2\",\"date\":\"2016-03-01 10:00:01\",\"type\":\"1\","
+            "\"did\":\"5551234567\",\"contact\":\"" SOAK_CONTACT "\","
+            "\"message\":\"Second, caf\\u00e9 & friends\"},"
+            "{\"id\":\"1\",\"date\":\"2016-03-01 10:00:00\",\"type\":\"0\","
+            "\"did\":\"5551234567\",\"contact\":\"" SOAK_CONTACT "\","
+            "\"message\":\"First\"}]}" :
+            "{\"status\":\"no_sms\"}";
+      } else if( NULL != strstr( request, "method=getMMS" ) ) {
+         body = "{\"status\":\"no_sms\"}";
+         if( g_atomic_int_compare_and_exchange( &soak_fresh_mms, 1, 0 ) ) {
+            g_snprintf(
+               mms, sizeof( mms ),
+               "{\"status\":\"success\",\"sms\":["
+               "{\"id\":\"4\",\"date\":\"2016-03-01 10:00:03\",\"type\":\"1\","
+               "\"did\":\"5551234567\",\"contact\":\"" SOAK_CONTACT "\","
+               "\"message\":\"Picture\","
+               "\"media\":[\"http://127.0.0.1:%u/media/4.png\"]}]}",
+               soak_port
+            );
+            body = mms;
+         }
+      } else if( NULL != strstr( request, "method=getDIDsInfo" ) ) {
+         body =
+            "{\"status\":\"success\",\"dids\":["
+            "{\"did\":\"5551234567\",\"sms_enabled\":\"1\"}]}";
+      } else if( NULL != strstr( request, "method=sendSMS" ) ) {
+         g_atomic_int_inc( &soak_sends );
+         body = "{\"status\":\"success\",\"sms\":23796}";
+      } else {
+         body = "{\"status\":\"success\"}";
+      }
+
+      header_size = g_snprintf(
+         header, sizeof( header ),
+         "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+         "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+         content_type, (unsigned long)strlen( body )
+      );
+      /* The client may already be gone, if its account signed off. */
+      if( 0 < send( client_fd, header, header_size, MSG_NOSIGNAL ) ) {
+         send( client_fd, body, strlen( body ), MSG_NOSIGNAL );
+      }
+      close( client_fd );
+   }
+
+   return NULL;
+}
+
+/* Event loop */
+
+struct SoakInput {
+   PurpleInputFunction function;
+   gpointer data;
+};
+
+static gboolean soak_input_invoke(
+   GIOChannel* source, GIOCondition condition, gpointer data
+) {
+   struct SoakInput* input = (struct SoakInput*)data;
+   PurpleInputCondition purple_condition = 0;
+
+   if( condition & SOAK_READ_COND ) {
+      purple_condition |= PURPLE_INPUT_READ;
+   }
+   if( condition & SOAK_WRITE_COND ) {
+      purple_condition |= PURPLE_INPUT_WRITE;
+   }
+   input->function(
+      input->data, g_io_channel_unix_get_fd( source ), purple_condition
+   );
+
+   return TRUE;
+}
+
+static guint soak_input_add(
+   gint fd, PurpleInputCondition condition, PurpleInputFunction function,
+   gpointer data
+) {
+   struct SoakInput* input;
+   GIOChannel* channel;
+   GIOCondition glib_condition = 0;
+   guint source;
+
+   input = g_new0( struct SoakInput, 1 );
+   input->function = function;
+   input->data = data;
+
+   if( condition & PURPLE_INPUT_READ ) {
+      glib_condition |= SOAK_READ_COND;
+   }
+   if( condition & PURPLE_INPUT_WRITE ) {
+      glib_condition |= SOAK_WRITE_COND;
+   }
+
+   channel = g_io_channel_unix_new( fd );
+   source = g_io_add_watch_full(
+      channel, G_PRIORITY_DEFAULT, glib_condition, soak_input_invoke, input,
+      g_free
+   );
+   g_io_channel_unref( channel );
+
+   return source;
+}
+
+/* libpurple's timers, on the default GLib main context. */
+static PurpleEventLoopUiOps soak_eventloop_ops = {
+   g_timeout_add,
+   g_source_remove,
+   soak_input_add,
+   g_source_remove,
+   NULL,
+   g_timeout_add_seconds,
+   NULL,
+   NULL,
+   NULL
+};
+
+static void soak_received_im(
+   PurpleAccount* account, char* sender, char* message,
+   PurpleConversation* conv, PurpleMessageFlags flags, gpointer data
+) {
+   soak_received++;
+}
+
+static void soak_run_pending( void ) {
+   while( g_main_context_iteration( NULL, FALSE ) );
+}
+
+/* One sign on, receive, send and sign off. Returns FALSE if it didn't     *
+ * get through all of it in time.                                          */
+static gboolean soak_cycle( PurpleAccount* account ) {
+   PurpleConnection* gc;
+   gint64 deadline;
+   gboolean done = FALSE;
+
+   g_atomic_int_set( &soak_fresh_sms, 1 );
+   g_atomic_int_set( &soak_fresh_mms, 1 );
+   g_atomic_int_set( &soak_sends, 0 );
+   g_atomic_int_set( &soak_downloads, 0 );
+   soak_received = 0;
+
+   /* Enabling it the first time signs it on, too. */
+   if( !purple_account_get_enabled( account, SOAK_UI ) ) {
+      purple_account_set_enabled( account, SOAK_UI, TRUE );
+   }
+   if( purple_account_is_disconnected( account ) ) {
+      purple_account_connect( account );
+   }
+   gc = purple_account_get_connection( account );
+   if( NULL == gc || !purple_account_is_connected( account ) ) {
+      return FALSE;
+   }
+
+   serv_send_im( gc, SOAK_CONTACT, "Soak test, please ignore", 0 );
+
+   deadline = g_get_monotonic_time() + SOAK_CYCLE_TIMEOUT_US;
+   while( !done && g_get_monotonic_time() < deadline ) {
+      soak_run_pending();
+      if( !purple_account_is_connected( account ) ) {
+         /* Dropped with an error; there's nothing more coming. */
+         break;
+      }
+      voipms_messages_timer( account );
+      done =
+         0 < soak_received &&
+         0 < g_atomic_int_get( &soak_sends ) &&
+         0 < g_atomic_int_get( &soak_downloads );
+      if( !done ) {
+         g_usleep( SOAK_TICK_US );
+      }
+   }
+
+   /* Sign off with the history, deletes and download likely unfinished,  *
+    * then close the conversation so it's opened afresh next time.         */
+   purple_account_disconnect( account );
+   while( NULL != purple_get_ims() ) {
+      purple_conversation_destroy( purple_get_ims()->data );
+   }
+   soak_run_pending();
+
+   return done;
+}
+
+static long soak_peak_rss( void ) {
+   struct rusage usage;
+
+   getrusage( RUSAGE_SELF, &usage );
+   return usage.ru_maxrss;
+}
+
+static void soak_remove_tree( const gchar* path ) {
+   GDir* dir;
+   const gchar* name;
+   gchar* child;
+
+   dir = g_dir_open( path, 0, NULL );
+   if( NULL != dir ) {
+      while( NULL != (name = g_dir_read_name( dir )) ) {
+         child = g_build_filename( path, name, NULL );
+         if( g_file_test( child, G_FILE_TEST_IS_DIR ) ) {
+            soak_remove_tree( child );
+         } else {
+            g_unlink( child );
+         }
+         g_free( child );
+      }
+      g_dir_close( dir );
+   }
+   g_rmdir( path );
+}
+
+int main( int argc, char** argv ) {
+   guint cycles = SOAK_DEFAULT_CYCLES,
+      cycle;
+   int listen_fd = -1,
+      exit_status = EXIT_FAILURE,
+      live = 0;
+   struct sockaddr_in address = { 0 };
+   socklen_t address_size = sizeof( address );
+   gchar* api_url = NULL,
+      * user_dir = NULL;
+   PurplePlugin* plugin;
+   PurpleAccount* account;
+   PurpleBuddy* buddy;
+   long rss = 0;
+   int handle;
+   GError* error = NULL;
+
+   if( 2 == argc ) {
+      cycles = MAX( SOAK_WARMUP_CYCLES + 1, atoi( argv[1] ) );
+   }
+
+   /* Let the kernel pick a port for the stand-in. */
+   listen_fd = socket( AF_INET, SOCK_STREAM, 0 );
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+   if(
+      0 > listen_fd ||
+      0 > bind( listen_fd, (struct sockaddr*)&address, sizeof( address ) ) ||
+      0 > listen( listen_fd, 16 ) ||
+      0 > getsockname(
+         listen_fd, (struct sockaddr*)&address, &address_size
+      )
+   ) {
+      perror( "Unable to listen on loopback" );
+      goto main_cleanup;
+   }
+   soak_port = ntohs( address.sin_port );
+   api_url = g_strdup_printf(
+      "http://127.0.0.1:%u/api/v1/rest.php", soak_port
+   );
+
+   /* Keep libpurple's files, and ours, out of the real profile. */
+   user_dir = g_dir_make_tmp( "voipms-soak-XXXXXX", &error );
+   if( NULL == user_dir ) {
+      fprintf( stderr, "%s\n", error->message );
+      g_error_free( error );
+      goto main_cleanup;
+   }
+
+   curl_global_init( CURL_GLOBAL_ALL );
+   g_thread_unref(
+      g_thread_new( "responder", soak_responder, GINT_TO_POINTER( listen_fd ) )
+   );
+
+   purple_util_set_user_dir( user_dir );
+   purple_debug_set_enabled( FALSE );
+   purple_eventloop_set_ui_ops( &soak_eventloop_ops );
+   if( !purple_core_init( SOAK_UI ) ) {
+      fprintf( stderr, "Unable to start libpurple.\n" );
+      goto main_cleanup;
+   }
+   purple_set_blist( purple_blist_new() );
+
+   /* Register the plugin the way a static prpl would be, rather than    *
+    * loading it from disk, so it's the code under test that runs.        */
+   plugin = purple_plugin_new( TRUE, NULL );
+   purple_init_plugin( plugin );
+   purple_plugins_probe( G_MODULE_SUFFIX );
+   if( plugin != purple_find_prpl( VOIPMS_PLUGIN_ID ) ) {
+      fprintf( stderr, "Another copy of the plugin is already loaded.\n" );
+      goto main_cleanup;
+   }
+
+   account = purple_account_new( "soak@example.com", VOIPMS_PLUGIN_ID );
+   purple_account_set_password( account, "s3cr3t&p@ss" );
+   purple_account_set_remember_password( account, TRUE );
+   purple_account_set_string( account, "api_url", api_url );
+   purple_account_set_bool( account, "mms", TRUE );
+   /* Low enough that some of each cycle's messages are held back. */
+   purple_account_set_int( account, "flood_contact", 2 );
+   purple_accounts_add( account );
+
+   /* A buddy for the contact, so there's something to route to. */
+   buddy = purple_buddy_new( account, SOAK_CONTACT, NULL );
+   purple_blist_add_buddy( buddy, NULL, NULL, NULL );
+
+   purple_signal_connect(
+      purple_conversations_get_handle(), "received-im-msg", &handle,
+      PURPLE_CALLBACK( soak_received_im ), NULL
+   );
+
+   printf( "%8s %12s %14s\n", "cycle", "live allocs", "peak RSS KiB" );
+   for( cycle = 1; cycles >= cycle; cycle++ ) {
+      if( !soak_cycle( account ) ) {
+         fprintf( stderr, "Cycle %u didn't finish.\n", cycle );
+         goto main_cleanup;
+      }
+
+      if( SOAK_WARMUP_CYCLES == cycle ) {
+         live = g_atomic_int_get( &soak_live );
+         rss = soak_peak_rss();
+      }
+      if( SOAK_WARMUP_CYCLES == cycle || cycles == cycle || 0 == cycle % 500 ) {
+         printf(
+            "%8u %12d %14ld\n", cycle, g_atomic_int_get( &soak_live ),
+            soak_peak_rss()
+         );
+      }
+   }
+
+   /* A leak of even one allocation a cycle would be thousands by now. */
+   if( SOAK_MAX_ALLOCATIONS < g_atomic_int_get( &soak_live ) - live ) {
+      fprintf(
+         stderr, "Leaked %d allocations over %u cycles.\n",
+         g_atomic_int_get( &soak_live ) - live, cycles - SOAK_WARMUP_CYCLES
+      );
+      goto main_cleanup;
+   }
+   if( SOAK_MAX_RSS_KIB < soak_peak_rss() - rss ) {
+      fprintf(
+         stderr, "Peak RSS grew %ld KiB over %u cycles.\n",
+         soak_peak_rss() - rss, cycles - SOAK_WARMUP_CYCLES
+      );
+      goto main_cleanup;
+   }
+
+   printf( "Memory stayed flat.\n" );
+   exit_status = EXIT_SUCCESS;
+
+main_cleanup:
+
+   /* Wakes the responder out of accept(), so it finishes on its own. */
+   if( 0 <= listen_fd ) {
+      shutdown( listen_fd, SHUT_RDWR );
+   }
+   if( NULL != user_dir ) {
+      soak_remove_tree( user_dir );
+   }
+   g_free( user_dir );
+   g_free( api_url );
+
+   return exit_status;
+}
@@ -0,0 +1,142 @@
+
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Print a saved flight recorder, one event a line, timed from the first.   */
+
+#include "voipms-core.h"
+
+#include <stdlib.h>
+
+static void voipms_trace_print(
+   const struct VoipMsTraceEvent* event, gint64 first
+) {
+   printf(
+      "%12.6f %-8s",
+      (gdouble)(event->time - first) / G_USEC_PER_SEC,
+      voipms_trace_type_name( event->type )
+   );
+   if( 0 != event->request ) {
+      printf( " #%-6u", event->request );
+   }
+
+   switch( event->type ) {
+      case VOIPMS_TRACE_POLL:
+         break;
+
+      case VOIPMS_TRACE_START:
+         printf( " %s", voipms_method_name( event->method ) );
+         break;
+
+      case VOIPMS_TRACE_FINISH:
+         printf(
+            " %s %u bytes in %.1f ms",
+            voipms_method_name( event->method ), event->bytes,
+            (gdouble)event->latency / 1000
+         );
+         if( CURLE_OK != event->status ) {
+            printf(
+               ": %s", curl_easy_strerror( (CURLcode)event->status )
+            );
+         }
+         break;
+
+      case VOIPMS_TRACE_STATUS:
+         printf(
+            " %s %s", voipms_method_name( event->method ),
+            voipms_trace_status_name( event->status )
+         );
+         break;
+
+      case VOIPMS_TRACE_BAD_RESPONSE:
+         printf(
+            " %s %u bytes", voipms_method_name( event->method ), event->bytes
+         );
+         break;
+
+      case VOIPMS_TRACE_RECEIVED:
+      case VOIPMS_TRACE_HELD:
+         printf(
+            " %s id %u, %u bytes",
+            voipms_method_name( event->method ), event->detail, event->bytes
+         );
+         break;
+
+      case VOIPMS_TRACE_SENT:
+         printf(
+            " %s %u bytes", voipms_method_name( event->method ), event->bytes
+         );
+         if( 0 < event->detail ) {
+            printf( ", %u attachment(s)", event->detail );
+         }
+         break;
+
+      default:
+         printf( " %u %u %u", event->status, event->bytes, event->detail );
+         break;
+   }
+
+   printf( "\n" );
+}
+
+int main( int argc, char** argv ) {
+   gchar* contents = NULL;
+   gsize length = 0,
+      offset;
+   struct VoipMsTraceEvent event;
+   gint64 first = 0;
+   GError* error = NULL;
+   int exit_status = EXIT_FAILURE;
+
+   if( 2 != argc ) {
+      fprintf( stderr, "Usage: %s FILE\n", argv[0] );
+      goto main_cleanup;
+   }
+
+   if( !g_file_get_contents( argv[1], &contents, &length, &error ) ) {
+      fprintf( stderr, "%s\n", error->message );
+      g_error_free( error );
+      goto main_cleanup;
+   }
+
+   if(
+      VOIPMS_TRACE_MAGIC_SIZE > length ||
+      memcmp( contents, VOIPMS_TRACE_MAGIC, VOIPMS_TRACE_MAGIC_SIZE )
+   ) {
+      fprintf( stderr, "%s isn't a flight recorder dump.\n", argv[1] );
+      goto main_cleanup;
+   }
+
+   for(
+      offset = VOIPMS_TRACE_MAGIC_SIZE;
+      length - offset >= sizeof( struct VoipMsTraceEvent );
+      offset += sizeof( struct VoipMsTraceEvent )
+   ) {
+      /* The events may not be aligned in the file's buffer. */
+      memcpy( &event, &(contents[offset]), sizeof( struct VoipMsTraceEvent ) );
+      if( VOIPMS_TRACE_MAGIC_SIZE == offset ) {
+         first = event.time;
+      }
+      voipms_trace_print( &event, first );
+   }
+
+   exit_status = EXIT_SUCCESS;
+
+main_cleanup:
+
+   g_free( contents );
+
+   return exit_status;
+}
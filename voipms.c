@@ -17,435 +17,1440 @@
 #include "voipms.h"
 
 static void voipms_init( PurplePlugin* );
+static gboolean voipms_load( PurplePlugin* );
+static gboolean voipms_unload( PurplePlugin* );
 static void voipms_destroy( PurplePlugin* );
 
 static PurplePlugin* _voipms_protocol = NULL;
+static guint _voipms_log_handler = 0;
+static PurpleCmdId _voipms_bulk_cmd = 0;
+static GHashTable* _voipms_routes = NULL; /* Number to struct VoipMsRoute. */
 
-static PurpleConnection* get_voipms_gc( const char* );
-static void messages_foreach_process( JsonArray*, guint, JsonNode*, gpointer );
 static void messages_foreach_serve( gpointer, gpointer );
-static void messages_foreach_free( gpointer );
+static void voipms_history_page_done(
+   PurpleAccount*, struct VoipMsHistory*, struct GcFuncDataMessageList*,
+   gboolean
+);
+static void voipms_history_append( PurpleAccount*, struct VoipMsMessage* );
+static gchar* voipms_trace_save( PurpleAccount*, gboolean );
+static gchar* voipms_account_path(
+   PurpleAccount*, const char*, const char*
+);
+static void voipms_snapshot_apply_did( PurpleAccount* );
+static gchar* voipms_route_name( PurpleAccount*, const char* );
+static void voipms_flood_log(
+   PurpleAccount*, const char*, const char*, time_t
+);
+static void voipms_media_download_done(
+   PurpleAccount*, struct VoipMsMediaDownload*, CURLcode
+);
+static void voipms_api_request_complete(
+   struct VoipMsSession*, struct VoipMsRequestData*, CURLcode
+);
+static void voipms_send_im_data_free( struct VoipMsSendImData* );
 
 /* Requests */
 
-static size_t voipms_api_request_write_body_callback(
-   void* contents, size_t size, size_t nmemb, void* userp
+/* The image store keeps the data where it is until we let go of it. */
+static GSList* voipms_api_args_add_image(
+   GSList* args, const gchar* key, PurpleStoredImage* image
 ) {
-   size_t realsize = size * nmemb;
-   struct RequestMemoryStruct* mem = (struct RequestMemoryStruct*)userp;
+   const char* extension = purple_imgstore_get_extension( image );
+   gchar* mime;
 
-   mem->memory = realloc( mem->memory, mem->size + realsize + 1 );
-   if( NULL == mem->memory ) {
-      /* TODO: Alert to memory problems, somehow. */
-      return 0;
-   }
+   mime = g_strdup_printf(
+      "image/%s", !strcmp( extension, "jpg" ) ? "jpeg" : extension
+   );
+   args = voipms_api_args_add_data(
+      args, key, mime,
+      purple_imgstore_get_data( image ), purple_imgstore_get_size( image ),
+      purple_imgstore_ref( image ), (GDestroyNotify)purple_imgstore_unref
+   );
+   g_free( mime );
 
-   memcpy( &(mem->memory[mem->size]), contents, realsize );
-   mem->size += realsize;
-   mem->memory[mem->size] = 0;
+   return args;
+}
 
-   return realsize;
+static void voipms_mms_free( struct VoipMsMms* mms ) {
+   g_free( mms->id );
+   g_free( mms->contact );
+   free( mms );
 }
 
-static void voipms_api_request(
-   VOIPMS_METHOD method, GSList* args, PurpleAccount* account, void* attachment
+static size_t voipms_media_write_callback(
+   void* contents, size_t size, size_t nmemb, void* userp
+) {
+   struct VoipMsMediaDownload* download = (struct VoipMsMediaDownload*)userp;
+
+   /* Straight to disk, so attachments never sit in memory. */
+   return fwrite( contents, size, nmemb, download->file ) * size;
+}
+
+static void voipms_media_request(
+   PurpleAccount* account, struct VoipMsMms* mms, const char* url, int index_
 ) {
-   CURL* curl = NULL;
-   GSList* arg_iter;
-   char* api_url = NULL;
-   size_t new_length = 1,
-      old_length = 0;
    struct VoipMsAccount* proto_data = account->gc->proto_data;
+   CURL* curl = NULL;
    struct VoipMsRequestData* request_data;
+   struct VoipMsMediaDownload* download;
+   gchar* media_dir,
+      * filename,
+      extension[8] = { 0 };
+   const char* url_extension;
+   int i;
+
+   /* Keep a short, alphanumeric extension from the URL, if there is one. */
+   url_extension = strrchr( url, '.' );
+   if( NULL != url_extension && NULL == strchr( url_extension, '/' ) ) {
+      for(
+         i = 0;
+         i < (int)sizeof( extension ) - 1 &&
+            g_ascii_isalnum( url_extension[i + 1] );
+         i++
+      ) {
+         extension[i] = url_extension[i + 1];
+      }
+   }
 
-   proto_data->requests_in_progress++;
-
-   /* Setup some buffers and stuff. */
-   request_data = calloc( 1, sizeof( struct VoipMsRequestData ) );
-   request_data->method = method;
-   request_data->attachment = attachment;
-   request_data->error_buffer = calloc( CURL_ERROR_SIZE, sizeof( char ) );
-   request_data->chunk.memory = calloc( 1, sizeof( char ) );
-   request_data->chunk.size = 0;
-
-   /* Add the credentials to the request. */
-   args = g_slist_append( args, g_strdup_printf( "api_username=%s",
-      purple_url_encode( account->username )
-   ) );
-   args = g_slist_append( args, g_strdup_printf( "api_password=%s",
-      purple_url_encode( account->password )
-   ) );
-
-   /* Add the method to the request. */
-   switch( method ) {
-      case VOIPMS_METHOD_GETSMS:
-         args = g_slist_append( args, g_strdup( "method=getSMS" ) );
-         break;
+   media_dir = g_build_filename( purple_user_dir(), "voipms", "media", NULL );
+   g_mkdir_with_parents( media_dir, 0700 );
+   filename = g_strdup_printf(
+      "%s-%d.%s", mms->id, index_, '\0' != extension[0] ? extension : "bin"
+   );
+   g_strdelimit( filename, G_DIR_SEPARATOR_S, '_' );
 
-      case VOIPMS_METHOD_SENDSMS:
-         args = g_slist_append( args, g_strdup( "method=sendSMS" ) );
-         break;
+   download = calloc( 1, sizeof( struct VoipMsMediaDownload ) );
+   download->mms = mms;
+   download->path = g_build_filename( media_dir, filename, NULL );
+   download->file = g_fopen( download->path, "wb" );
+   g_free( media_dir );
+   g_free( filename );
 
-      case VOIPMS_METHOD_DELETESMS:
-         args = g_slist_append( args, g_strdup( "method=deleteSMS" ) );
-         break;
-   }
+   mms->pending++;
 
-   /* Build the query string. */
-   arg_iter = args;
-   api_url = g_strdup_printf( "%s?", purple_account_get_string(
-      account, "api_url", VOIPMS_PLUGIN_DEFAULT_API_URL
-   ) );
-   new_length = strlen( api_url ) + 1;
-   old_length = strlen( api_url );
-   while( NULL != arg_iter ) {
-      /* Append each arg to the query string. */
-      /* TODO: Use glib functions for this? */
-      new_length += strlen( arg_iter->data );
-      api_url = realloc( api_url, new_length );
-      memcpy(
-         &(api_url[old_length]), arg_iter->data, strlen( arg_iter->data )
+   request_data = voipms_request_data_new(
+      proto_data->session, VOIPMS_METHOD_MEDIA, download
+   );
+
+   if( NULL == download->file ) {
+      purple_debug_error(
+         "voipms", "Unable to open %s for writing.\n", download->path
       );
-      api_url[new_length - 1] = 0;
-      old_length = new_length - 1;
-
-      /* If NULL != g_slist_next() then append & to the query string. */
-      if( NULL != g_slist_next( arg_iter ) ) {
-         new_length += 1;
-         old_length += 1;
-         api_url = realloc( api_url, new_length );
-         api_url[new_length - 2] = '&';
-         api_url[new_length - 1] = 0;
-      }
 
-      arg_iter = g_slist_next( arg_iter );
+      /* Nothing was started, so finish it off as a failure right away. */
+      voipms_api_request_complete(
+         proto_data->session, request_data, CURLE_WRITE_ERROR
+      );
+      voipms_request_data_free( request_data );
+      return;
    }
 
-   /* Setup the request. */
    curl = curl_easy_init();
-   curl_easy_setopt( curl, CURLOPT_URL, api_url );
+   curl_easy_setopt( curl, CURLOPT_URL, url );
+   curl_easy_setopt( curl, CURLOPT_WRITEFUNCTION, voipms_media_write_callback );
+   curl_easy_setopt( curl, CURLOPT_WRITEDATA, download );
+   curl_easy_setopt( curl, CURLOPT_FOLLOWLOCATION, 1 );
    curl_easy_setopt(
-      curl, CURLOPT_WRITEFUNCTION, voipms_api_request_write_body_callback
+      curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)VOIPMS_MMS_MAX_FILE_SIZE
    );
-   curl_easy_setopt( curl, CURLOPT_PRIVATE, request_data );
-   curl_easy_setopt( curl, CURLOPT_WRITEDATA, &(request_data->chunk) );
-   curl_easy_setopt( curl, CURLOPT_ERRORBUFFER, request_data->error_buffer );
-   curl_easy_setopt( curl, CURLOPT_FAILONERROR, 1 );
-
-   curl_multi_add_handle( proto_data->multi_handle, curl );
-
-   if( NULL != api_url ) {
-      free( api_url );
-   }
-
-   g_slist_free_full( args, g_free );
 
+   voipms_request_start( proto_data->session, curl, request_data );
 }
 
-static void voipms_api_request_progress( PurpleAccount* account ) {
+static void voipms_media_download_done(
+   PurpleAccount* account, struct VoipMsMediaDownload* download,
+   CURLcode result
+) {
    struct VoipMsAccount* proto_data = account->gc->proto_data;
-   int running_previously = proto_data->still_running,
-      queue_count;
-   struct CURLMsg* msg = NULL;
-   struct VoipMsRequestData* request_data = NULL;
-   JsonParser* parser = NULL;
-   JsonNode* root = NULL;
-   JsonObject* response = NULL;
-   JsonArray* messages = NULL;
-   const gchar* status = NULL;
-   struct GcFuncDataMessageList message_list = { NULL, account };
-   struct VoipMsSendImData* send_im_data = NULL;
+   struct VoipMsMms* mms = download->mms;
+   GSList* api_args = NULL;
+   gchar* data = NULL,
+      * link,
+      * escaped;
+   gsize size = 0;
+   long written = -1;
+   int image_id;
+
+   if( NULL != download->file ) {
+      written = ftell( download->file );
+      fclose( download->file );
+   }
 
-   curl_multi_perform( proto_data->multi_handle, &(proto_data->still_running) );
+   if( CURLE_OK != result ) {
+      purple_debug_error(
+         "voipms", "Unable to download MMS attachment: %d\n", result
+      );
+      g_unlink( download->path );
+      mms->failed = TRUE;
+      goto media_download_cleanup;
+   }
 
-   if( running_previously > proto_data->still_running ) {
-      /* Nothing to process. */
-      goto api_request_progress_cleanup;
+   /* Only small attachments get loaded for display; big ones are linked, *
+    * as are held ones, since the log can't keep an image of its own. The  *
+    * size is checked first so a big one is never read into memory.       */
+   if(
+      !mms->held && 0 <= written && VOIPMS_MMS_INLINE_MAX_SIZE >= written &&
+      g_file_get_contents( download->path, &data, &size, NULL )
+   ) {
+      /* The image store takes ownership of data. */
+      image_id = purple_imgstore_add_with_id( data, size, download->path );
+      data = NULL;
+      link = g_strdup_printf( "<img id=\"%d\">", image_id );
+      serv_got_im(
+         account->gc, mms->contact, link,
+         PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_IMAGES, mms->time
+      );
+      purple_imgstore_unref_by_id( image_id );
+   } else {
+      escaped = g_markup_escape_text( download->path, -1 );
+      link = g_strdup_printf(
+         "<a href=\"file://%s\">%s</a>", escaped, escaped
+      );
+      g_free( escaped );
+      if( mms->held ) {
+         voipms_flood_log( account, mms->contact, link, mms->time );
+      } else {
+         serv_got_im(
+            account->gc, mms->contact, link, PURPLE_MESSAGE_RECV, mms->time
+         );
+      }
    }
+   g_free( link );
 
-   #if 0
-   purple_debug_info( "voipms", "Checking requests...\n" );
-   #endif
+media_download_cleanup:
 
-   msg = curl_multi_info_read( proto_data->multi_handle, &queue_count );
+   g_free( data );
+   g_free( download->path );
+   free( download );
 
-   if( NULL == msg || CURLMSG_DONE != msg->msg ) {
-      /* Don't know how to handle this. */
-      goto api_request_progress_cleanup;
+   mms->pending--;
+   if( 0 < mms->pending ) {
+      return;
    }
 
-   curl_easy_getinfo(
-      msg->easy_handle, CURLINFO_PRIVATE, (char*)(&request_data)
-   );
+   /* Only delete the message once every attachment has been saved. */
+   if(
+      !mms->failed && !mms->relayed &&
+      purple_account_get_bool( account, "delete", TRUE )
+   ) {
+      api_args = voipms_api_args_add( api_args, "id", mms->id );
+      voipms_api_request(
+         proto_data->session, VOIPMS_METHOD_DELETEMMS, api_args, NULL
+      );
+   }
 
-   /* A valid request has finished, at any rate. */
-   proto_data->requests_in_progress--;
+   voipms_mms_free( mms );
+}
 
-   if( NULL == request_data ) {
-      /* Don't know how to handle this. */
-      purple_debug_info(
-         "voipms", "NULL request_data returned for request.\n"
+/* Hand a finished request to whoever owns its attachment. Every request goes *
+ * through here exactly once, unless it's cancelled by voipms_close().        */
+static void voipms_api_request_complete(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data,
+   CURLcode result
+) {
+   PurpleAccount* account = (PurpleAccount*)session->user_data;
+   JsonParser* parser = NULL;
+   JsonObject* response = NULL;
+   const gchar* status = NULL;
+   struct GcFuncDataMessageList message_list =
+      { NULL, account, FALSE, FALSE, FALSE };
+   struct VoipMsSendImData* send_im_data = NULL;
+   struct VoipMsHistory* history = NULL;
+   gboolean history_ok = FALSE,
+      send_ok = FALSE;
+   struct VoipMsOutboxEntry* outbox_entry = NULL;
+   VOIPMS_OUTBOX_RESULT outbox_result = VOIPMS_OUTBOX_UNREACHABLE;
+   struct VoipMsAccount* proto_data = account->gc->proto_data;
+   gchar* msg,
+      * path,
+      * contact;
+   GList* message_iter;
+   struct VoipMsMessage* message;
+
+   if( VOIPMS_METHOD_MEDIA == request_data->method ) {
+      /* Attachments went straight to disk; there's no JSON to parse. */
+      voipms_media_download_done(
+         account,
+         (struct VoipMsMediaDownload*)(request_data->attachment),
+         result
       );
-      goto api_request_progress_curl_cleanup;
+      return;
    }
 
    /* Prepare the kind of attachment we'll be using. */
    switch( request_data->method ) {
       case VOIPMS_METHOD_SENDSMS:
+         outbox_entry = (struct VoipMsOutboxEntry*)(request_data->attachment);
+         break;
+
+      case VOIPMS_METHOD_SENDMMS:
          send_im_data = (struct VoipMsSendImData*)(request_data->attachment);
-         send_im_data->processed = TRUE;
+         break;
+
+      case VOIPMS_METHOD_GETSMS:
+         history = (struct VoipMsHistory*)(request_data->attachment);
          break;
 
       default:
          break;
    }
 
-   /* Parse the JSON response. */
    parser = json_parser_new();
-   if( !json_parser_load_from_data(
-      parser,
-      request_data->chunk.memory,
-      request_data->chunk.size,
-      NULL
-   ) ) {
-      purple_debug_error(
-         "voipms",
-         "Error parsing response: %s\n",
-         request_data->chunk.memory
-      );
-      goto api_request_progress_curl_cleanup;
+   status = voipms_api_request_status( request_data, result, parser, &response );
+   if( NULL == response ) {
+      goto api_request_complete_cleanup;
    }
-   root = json_parser_get_root( parser );
-
-   /* TODO: Make sure the response was successful. */
-   if( NULL == root ) {
-      if( NULL != send_im_data ) {
-         send_im_data->error_buffer = g_strdup_printf(
-            "Error parsing response: %s\n", request_data->chunk.memory
-         );
-      }
-      purple_debug_error(
-         "voipms",
-         "Error parsing response: %s\n",
-         request_data->chunk.memory
-      );
-      goto api_request_progress_curl_cleanup;
+   if( NULL != history && !strcmp( status, "no_sms" ) ) {
+      /* An empty page is fine; older pages may still have messages. */
+      history_ok = TRUE;
+      goto api_request_complete_cleanup;
    }
-
-   response = json_node_get_object( root );
-
-   /* Get the status of the request. */
-   status = json_object_get_string_member( response, "status" );
    if( strcmp( status, "success" ) ) {
-      purple_debug_error( "voipms", "Request status: %s\n", status );
-      if( NULL != send_im_data ) {
-         send_im_data->error_buffer = g_strdup( request_data->error_buffer );
+      if( NULL != outbox_entry && voipms_outbox_status_is_final( status ) ) {
+         outbox_result = VOIPMS_OUTBOX_REJECTED;
       }
-      goto api_request_progress_curl_cleanup;
+      goto api_request_complete_cleanup;
    }
 
    switch( request_data->method ) {
       case VOIPMS_METHOD_GETSMS:
-         /* Parse the messages and reverse them so that newest come last      *
-          * before we serve them.                                             */
-         messages = json_object_get_array_member( response, "sms" );  
-         json_array_foreach_element(
-            messages, messages_foreach_process, &message_list
-         );
-         message_list.messages = g_list_reverse( message_list.messages );
-         g_list_foreach( message_list.messages, messages_foreach_serve, NULL );
+      case VOIPMS_METHOD_GETMMS:
+         /* Parse the messages, oldest first, before we serve them. */
+         message_list.mms = VOIPMS_METHOD_GETMMS == request_data->method;
+         message_list.replayed = request_data->replayed;
+         message_list.relayed = request_data->relayed;
+         voipms_api_parse_messages( response, &message_list );
+         for(
+            message_iter = message_list.messages;
+            NULL != message_iter;
+            message_iter = g_list_next( message_iter )
+         ) {
+            message = (struct VoipMsMessage*)message_iter->data;
+            contact = voipms_route_name( account, message->contact );
+            g_free( message->contact );
+            message->contact = contact;
+         }
+         if( NULL != history ) {
+            /* History is only shown, never served or deleted. */
+            history_ok = TRUE;
+         } else {
+            g_list_foreach(
+               message_list.messages, messages_foreach_serve, &message_list
+            );
+         }
          break;
 
       case VOIPMS_METHOD_SENDSMS:
-         send_im_data = (struct VoipMsSendImData*)(request_data->attachment);
-         send_im_data->success = TRUE;
+         outbox_result = VOIPMS_OUTBOX_SENT;
+         break;
+
+      case VOIPMS_METHOD_SENDMMS:
+         send_ok = TRUE;
+         break;
+
+      case VOIPMS_METHOD_GETDIDSINFO:
+         /* A replayed capture may be from some other account entirely. */
+         if( request_data->replayed ) {
+            break;
+         }
+         g_strfreev( proto_data->snapshot->dids );
+         proto_data->snapshot->dids = voipms_api_parse_dids( response );
+         voipms_snapshot_apply_did( account );
+         path = voipms_account_path( account, "snapshot", "vmssnp" );
+         voipms_snapshot_save( proto_data->snapshot, path );
+         g_free( path );
          break;
 
       default:
          break;
    }
 
-api_request_progress_curl_cleanup:
+api_request_complete_cleanup:
+
+   /* Keep a trace of what led up to anything that went wrong. */
+   if(
+      NULL == response ||
+      VOIPMS_OUTBOX_REJECTED == outbox_result ||
+      (NULL != send_im_data && !send_ok)
+   ) {
+      g_free( voipms_trace_save( account, TRUE ) );
+   }
+
+   if( NULL != history ) {
+      voipms_history_page_done( account, history, &message_list, history_ok );
+   }
 
-   /* Cleanup the handle we were just working with. */
-   curl_multi_remove_handle( proto_data->multi_handle, msg->easy_handle );
-   curl_easy_cleanup( msg->easy_handle );
+   if( NULL != outbox_entry ) {
+      if( VOIPMS_OUTBOX_REJECTED == outbox_result ) {
+         msg = g_strdup_printf(
+            "VOIP.ms refused to send your message to %s: %s",
+            outbox_entry->dst, status
+         );
+         purple_conv_present_error( outbox_entry->dst, account, msg );
+         g_free( msg );
+      }
+      voipms_outbox_done( session, outbox_entry, outbox_result );
+   }
 
-api_request_progress_cleanup:
+   if( NULL != send_im_data ) {
+      if( !send_ok ) {
+         msg = g_strdup_printf(
+            "There was a problem contacting the VOIP.ms API: %s", status
+         );
+         purple_conv_present_error( send_im_data->who, account, msg );
+         g_free( msg );
+      }
+      voipms_send_im_data_free( send_im_data );
+   }
 
    if( NULL != parser ) {
       g_object_unref( parser );
    }
 
-   if( NULL != request_data ) {
-      free( request_data->chunk.memory );
-      if( NULL != request_data->error_buffer ) {
-         free( request_data->error_buffer );
+   g_list_free_full( message_list.messages, voipms_message_free );
+}
+
+/* Release whatever the attachment of a request that will never complete      *
+ * holds that nobody else owns.                                               */
+static void voipms_request_cancel(
+   struct VoipMsSession* session, struct VoipMsRequestData* request_data
+) {
+   struct VoipMsMediaDownload* download;
+
+   switch( request_data->method ) {
+      case VOIPMS_METHOD_SENDMMS:
+         voipms_send_im_data_free(
+            (struct VoipMsSendImData*)(request_data->attachment)
+         );
+         break;
+
+      case VOIPMS_METHOD_MEDIA:
+         /* Don't leave half a file behind; the message wasn't deleted, so   *
+          * it'll be downloaded again next time.                            */
+         download = (struct VoipMsMediaDownload*)(request_data->attachment);
+         fclose( download->file );
+         g_unlink( download->path );
+         download->mms->pending--;
+         if( 0 == download->mms->pending ) {
+            voipms_mms_free( download->mms );
+         }
+         g_free( download->path );
+         free( download );
+         break;
+
+      default:
+         /* Outbox entries and history pages belong to tables of their own,  *
+          * which get torn down after this.                                  */
+         break;
+   }
+}
+
+/* Where the account keeps a file of the given kind, under the Purple user *
+ * directory. The directory is made if it isn't there yet.                 */
+static gchar* voipms_account_path(
+   PurpleAccount* acct, const char* kind, const char* extension
+) {
+   gchar* dir,
+      * filename,
+      * path;
+
+   dir = g_build_filename( purple_user_dir(), "voipms", kind, NULL );
+   g_mkdir_with_parents( dir, 0700 );
+   filename = g_strdup_printf( "%s.%s", acct->username, extension );
+   g_strcanon(
+      filename,
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_",
+      '_'
+   );
+   path = g_build_filename( dir, filename, NULL );
+   g_free( dir );
+   g_free( filename );
+
+   return path;
+}
+
+/* Flight recorder */
+
+/* Save the flight recorder over the account's last dump. Dumps on error    *
+ * are spaced out, so a dead network doesn't rewrite it every poll. Returns *
+ * where it went, or NULL if it didn't.                                     */
+static gchar* voipms_trace_save( PurpleAccount* acct, gboolean on_error ) {
+   struct VoipMsAccount* proto_data = acct->gc->proto_data;
+   gint64 now = g_get_monotonic_time() / G_USEC_PER_SEC;
+   gchar* path;
+
+   if( on_error ) {
+      if(
+         0 != proto_data->trace_dumped &&
+         now < proto_data->trace_dumped + VOIPMS_TRACE_DUMP_SECONDS
+      ) {
+         return NULL;
       }
-      
-      /* Don't free the send_im_data attachment here, since we use it to send *
-       * back success flag.                                                   */
+      proto_data->trace_dumped = now;
    }
 
-   g_list_free_full( message_list.messages, messages_foreach_free );
+   path = voipms_account_path( acct, "trace", "vmstrc" );
+   if( !voipms_trace_dump( path ) ) {
+      g_free( path );
+      return NULL;
+   }
+   purple_debug_info( "voipms", "Saved the flight recorder to %s.\n", path );
 
-   return;
+   return path;
 }
 
-/* Helpers */
+static void voipms_action_trace( PurplePluginAction* action ) {
+   PurpleConnection* gc = (PurpleConnection*)action->context;
+   gchar* path,
+      * msg;
+
+   path = voipms_trace_save( gc->account, FALSE );
+   if( NULL == path ) {
+      purple_notify_error(
+         gc, "Flight Recorder", "Unable to save the flight recorder.", NULL
+      );
+      return;
+   }
 
-static gchar* str_replace( gchar* string, const gchar* from, const gchar* to ) {
-   gchar* new_string;
+   msg = g_strdup_printf(
+      "Saved to %s. It holds no message text; read it with voipms-trace.",
+      path
+   );
+   purple_notify_info(
+      gc, "Flight Recorder", "Flight recorder saved.", msg
+   );
+   g_free( msg );
+   g_free( path );
+}
 
-   //while( NULL != strstr( string, from ) ) {
-      new_string = g_strjoinv( to, g_strsplit( string, from, -1 ) );
-   //}
+/* Capture and replay */
 
-   return new_string;
+static gchar* voipms_capture_dir( void ) {
+   return g_build_filename( purple_user_dir(), "voipms", "capture", NULL );
 }
 
-static PurpleConnection* get_voipms_gc( const char* username ) {
-   PurpleAccount* acct = purple_accounts_find( username, VOIPMS_PLUGIN_ID );
-   if( acct && purple_account_is_connected( acct ) ) {
-      return acct->gc;
-   } else {
-      return NULL;
+/* A new file per session, so one busy day doesn't clobber another. */
+static gchar* voipms_capture_path( PurpleAccount* acct ) {
+   gchar* capture_dir,
+      * filename,
+      * path;
+   char date_buffer[VOIPMS_DATE_BUFFER_SIZE];
+   time_t now;
+
+   now = time( NULL );
+   strftime(
+      date_buffer, sizeof( date_buffer ), "%Y%m%d-%H%M%S", localtime( &now )
+   );
+   capture_dir = voipms_capture_dir();
+   g_mkdir_with_parents( capture_dir, 0700 );
+   filename = g_strdup_printf( "%s-%s.vmscap", acct->username, date_buffer );
+   g_strcanon(
+      filename,
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_",
+      '_'
+   );
+   path = g_build_filename( capture_dir, filename, NULL );
+   g_free( capture_dir );
+   g_free( filename );
+
+   return path;
+}
+
+static void voipms_replay_free( struct VoipMsReplay* replay ) {
+   if( replay->timer ) {
+      purple_timeout_remove( replay->timer );
    }
+   g_free( replay->contents );
+   free( replay );
 }
 
-static void messages_foreach_free( gpointer data ) {
-   struct VoipMsMessage* message = (struct VoipMsMessage*)data;
+static void voipms_replay_finish( PurpleAccount* acct, const char* error ) {
+   struct VoipMsAccount* proto_data = acct->gc->proto_data;
+   struct VoipMsReplay* replay = proto_data->replay;
+   gchar* summary;
+
+   summary = g_strdup_printf(
+      "Replayed %u responses in %.1f seconds at %ux.\n"
+      "Completion took %.1f us on average and %.1f us at worst.%s%s",
+      replay->responses,
+      (double)(g_get_monotonic_time() - replay->started) / G_USEC_PER_SEC,
+      replay->speed,
+      0 == replay->responses ?
+         0.0 : (double)replay->completion_total / replay->responses,
+      (double)replay->completion_max,
+      NULL == error ? "" : "\n\nStopped early: ",
+      NULL == error ? "" : error
+   );
+   purple_debug_info( "voipms", "%s\n", summary );
+   purple_notify_info(
+      acct->gc, "Replay Finished", "Replay finished.", summary
+   );
+   g_free( summary );
+
+   /* The timer source is finished by our caller returning FALSE. */
+   replay->timer = 0;
+   voipms_replay_free( replay );
+   proto_data->replay = NULL;
+}
+
+/* Hand every captured response that's due to the completion path, as if   *
+ * it had just come off the wire.                                          */
+static gboolean voipms_replay_timer( PurpleAccount* acct ) {
+   struct VoipMsAccount* proto_data = acct->gc->proto_data;
+   struct VoipMsReplay* replay = proto_data->replay;
+   struct VoipMsCaptureRecord record;
+   struct VoipMsRequestData* request_data;
+   const gchar* body;
+   gsize next;
+   gint64 elapsed,
+      completion;
+
+   elapsed = (g_get_monotonic_time() - replay->started) * replay->speed;
+
+   while( replay->offset < replay->length ) {
+      next = replay->offset;
+      if(
+         !voipms_capture_read(
+            replay->contents, replay->length, &next, &record, &body
+         )
+      ) {
+         voipms_replay_finish( acct, "truncated record" );
+         return FALSE;
+      }
+
+      if( record.started + record.latency > elapsed ) {
+         /* Not due yet. */
+         return TRUE;
+      }
+      replay->offset = next;
+
+      /* Media went to disk rather than into a response, so there's nothing  *
+       * to hand back for those.                                             */
+      if( VOIPMS_METHOD_MEDIA != record.method ) {
+         request_data = voipms_request_data_new_replay( &record, body );
+
+         completion = g_get_monotonic_time();
+         voipms_api_request_complete(
+            proto_data->session, request_data, record.result
+         );
+         completion = g_get_monotonic_time() - completion;
+
+         voipms_request_data_free( request_data );
+
+         replay->responses++;
+         replay->completion_total += completion;
+         replay->completion_max = MAX( replay->completion_max, completion );
+      }
+   }
+
+   voipms_replay_finish( acct, NULL );
+   return FALSE;
+}
 
-   if( NULL == message || NULL == message->message ) {
+static void voipms_replay_start(
+   PurpleConnection* gc, PurpleRequestFields* fields
+) {
+   struct VoipMsAccount* proto_data = gc->proto_data;
+   struct VoipMsReplay* replay;
+   const char* path;
+   int speed;
+   GError* error = NULL;
+
+   if( NULL != proto_data->replay ) {
+      purple_notify_error(
+         gc, "Replay Captured Traffic", "A replay is already running.", NULL
+      );
       return;
    }
 
-   g_free( message->id );
-   g_free( message->contact );
-   g_free( message->message );
+   path = purple_request_fields_get_string( fields, "path" );
+   speed = purple_request_fields_get_integer( fields, "speed" );
+
+   replay = calloc( 1, sizeof( struct VoipMsReplay ) );
+   replay->speed = CLAMP( speed, 1, VOIPMS_REPLAY_MAX_SPEED );
+   if(
+      NULL == path ||
+      !g_file_get_contents( path, &(replay->contents), &(replay->length), &error )
+   ) {
+      purple_notify_error(
+         gc, "Replay Captured Traffic", "Unable to read the capture.",
+         NULL == error ? NULL : error->message
+      );
+      goto replay_start_cleanup;
+   }
+
+   if(
+      VOIPMS_CAPTURE_MAGIC_SIZE > replay->length ||
+      memcmp( replay->contents, VOIPMS_CAPTURE_MAGIC, VOIPMS_CAPTURE_MAGIC_SIZE )
+   ) {
+      purple_notify_error(
+         gc, "Replay Captured Traffic", "That isn't a capture file.", path
+      );
+      goto replay_start_cleanup;
+   }
+
+   purple_debug_info(
+      "voipms", "Replaying %s at %ux...\n", path, replay->speed
+   );
+
+   /* Polling stops while this runs, so nothing real gets deleted on the    *
+    * strength of a replayed message.                                       */
+   replay->offset = VOIPMS_CAPTURE_MAGIC_SIZE;
+   replay->started = g_get_monotonic_time();
+   replay->timer = purple_timeout_add(
+      VOIPMS_REPLAY_TICK_MS, (GSourceFunc)voipms_replay_timer, gc->account
+   );
+   proto_data->replay = replay;
+   replay = NULL;
+
+replay_start_cleanup:
+
+   if( NULL != error ) {
+      g_error_free( error );
+   }
+
+   if( NULL != replay ) {
+      voipms_replay_free( replay );
+   }
 }
 
-static void messages_foreach_serve( gpointer data, gpointer user_data ) {
-   struct VoipMsMessage* message = (struct VoipMsMessage*)data;
-   GSList* api_args = NULL;
-   struct VoipMsAccount* proto_data = message->account->gc->proto_data;
-   time_t message_time,
-      hours_offset;
+static void voipms_action_replay( PurplePluginAction* action ) {
+   PurpleConnection* gc = (PurpleConnection*)action->context;
+   PurpleRequestFields* fields;
+   PurpleRequestFieldGroup* group;
+   PurpleRequestField* field;
+   gchar* capture_dir;
+
+   fields = purple_request_fields_new();
+   group = purple_request_field_group_new( NULL );
+   purple_request_fields_add_group( fields, group );
+
+   capture_dir = voipms_capture_dir();
+   field = purple_request_field_string_new(
+      "path", "Capture File", capture_dir, FALSE
+   );
+   purple_request_field_set_required( field, TRUE );
+   purple_request_field_group_add_field( group, field );
+   g_free( capture_dir );
+
+   field = purple_request_field_int_new( "speed", "Speed (1x to 100x)", 1 );
+   purple_request_field_group_add_field( group, field );
+
+   purple_request_fields(
+      gc, "Replay Captured Traffic", "Replay captured API traffic",
+      "Responses are fed back through the plugin at the pace they were "
+      "captured, sped up as asked. Polling is paused until it's done.",
+      fields,
+      "Replay", G_CALLBACK( voipms_replay_start ),
+      "Cancel", NULL,
+      gc->account, NULL, NULL, gc
+   );
+}
+
+/* Helpers */
+
+static time_t voipms_message_time( const struct VoipMsMessage* message ) {
+   struct tm timeinfo = message->timeinfo;
+   time_t hours_offset;
 
    hours_offset = purple_account_get_int( message->account, "hours_offset", 0 );
 
    /* Convert hours_offset from hours (stored) to seconds (for adding). */
    hours_offset = hours_offset * 60 * 60;
-   message_time = mktime( &(message->timeinfo) ) + hours_offset;
-   
-   /* Pass the message on to the user. */
-   serv_got_im(
-      message->account->gc,
-      message->contact,
-      message->message,
-      PURPLE_MESSAGE_RECV,
-      message_time
-   );
+   return mktime( &timeinfo ) + hours_offset;
+}
 
-   /* Delete the message from the server. */
-   if( !purple_account_get_bool( message->account, "delete", TRUE ) ) {
-      goto messages_serve_cleanup;
+static gint voipms_message_compare_time( gconstpointer a, gconstpointer b ) {
+   time_t time_a = voipms_message_time( (const struct VoipMsMessage*)a ),
+      time_b = voipms_message_time( (const struct VoipMsMessage*)b );
+
+   return time_a < time_b ? -1 : (time_a > time_b ? 1 : 0);
+}
+
+/* Routing */
+
+/* A number as everything here keys it, or a copy of who if it isn't one. */
+static gchar* voipms_canonical( const char* who ) {
+   gchar number[VOIPMS_NUMBER_SIZE];
+
+   if( !voipms_number_canonical( who, number, sizeof( number ) ) ) {
+      return g_strdup( who );
    }
+   return g_strdup( number );
+}
 
-   /* Build and send the API request. */
-   api_args = g_slist_append(
-      api_args,
-      g_strdup_printf( "id=%s", message->id )
-   );
+static gchar* voipms_dialable( const char* who ) {
+   gchar number[VOIPMS_NUMBER_SIZE];
 
-   voipms_api_request(
-      VOIPMS_METHOD_DELETESMS, api_args, message->account, NULL
-   );
+   if( !voipms_number_dialable( who, number, sizeof( number ) ) ) {
+      return g_strdup( who );
+   }
+   return g_strdup( number );
+}
+
+/* Lets libpurple match buddies and conversations however they're written. *
+ * This is the dialable form, not E.164, since libpurple names log folders *
+ * and finds buddies by it and they've always been plain 10-digit numbers. *
+ * NULL hands anything that isn't a number back to the default.            */
+static const char* voipms_normalize(
+   const PurpleAccount* acct, const char* who
+) {
+   static gchar number[VOIPMS_NUMBER_SIZE];
+
+   if(
+      NULL == who ||
+      !voipms_number_dialable( who, number, sizeof( number ) )
+   ) {
+      return NULL;
+   }
+   return number;
+}
 
-   /* Block until request completes. */
-   while( proto_data->still_running ) {
-      voipms_api_request_progress( message->account );
-      /* TODO: Delay for a second or so. */
+static void voipms_route_free( gpointer data ) {
+   struct VoipMsRoute* route = (struct VoipMsRoute*)data;
+
+   g_slist_free( route->conversations );
+   free( route );
+}
+
+static struct VoipMsRoute* voipms_route_get( const char* who, gboolean add ) {
+   struct VoipMsRoute* route;
+   gchar* number;
+
+   if( NULL == _voipms_routes || NULL == who ) {
+      return NULL;
    }
 
-messages_serve_cleanup:
+   number = voipms_canonical( who );
+   route = g_hash_table_lookup( _voipms_routes, number );
+   if( NULL == route && add ) {
+      route = calloc( 1, sizeof( struct VoipMsRoute ) );
+      g_hash_table_insert( _voipms_routes, number, route );
+      number = NULL;
+   }
+   g_free( number );
 
-   return;
+   return route;
 }
 
-static void messages_foreach_process(
-   JsonArray* array, guint index_, JsonNode* element_node, gpointer user_data
+/* Forget a number once nothing's left under it. */
+static void voipms_route_done( const char* who, struct VoipMsRoute* route ) {
+   gchar* number;
+
+   if( NULL != route->account || NULL != route->conversations ) {
+      return;
+   }
+
+   number = voipms_canonical( who );
+   g_hash_table_remove( _voipms_routes, number );
+   g_free( number );
+}
+
+static gboolean voipms_route_is_ours( PurpleAccount* acct ) {
+   return NULL != acct &&
+      !strcmp( purple_account_get_protocol_id( acct ), VOIPMS_PLUGIN_ID );
+}
+
+/* The name to give a message from who on acct: the buddy's, if there is   *
+ * one, so it lands in the same conversation however the API wrote it.     *
+ * libpurple already hashes buddies by their normalized name, and keeps    *
+ * that up to date through renames, so they're looked up there.           */
+static gchar* voipms_route_name( PurpleAccount* acct, const char* who ) {
+   struct VoipMsRoute* route;
+   PurpleBuddy* buddy;
+   GSList* iter;
+
+   buddy = purple_find_buddy( acct, who );
+   if( NULL != buddy ) {
+      return g_strdup( purple_buddy_get_name( buddy ) );
+   }
+
+   route = voipms_route_get( who, FALSE );
+   if( NULL != route ) {
+      for(
+         iter = route->conversations;
+         NULL != iter;
+         iter = g_slist_next( iter )
+      ) {
+         if( acct == purple_conversation_get_account( iter->data ) ) {
+            return g_strdup( purple_conversation_get_name( iter->data ) );
+         }
+      }
+   }
+
+   return voipms_dialable( who );
+}
+
+static void voipms_route_account( PurpleAccount* acct, const char* did ) {
+   struct VoipMsRoute* route;
+
+   if( NULL == did || '\0' == did[0] ) {
+      return;
+   }
+
+   route = voipms_route_get( did, NULL != acct );
+   if( NULL == route ) {
+      return;
+   }
+   route->account = acct;
+   voipms_route_done( did, route );
+}
+
+static void voipms_route_conversation_created(
+   PurpleConversation* conv, gpointer data
 ) {
-   struct GcFuncDataMessageList* gcfdata =
-      (struct GcFuncDataMessageList*)user_data;
-   JsonObject* message_json;
+   struct VoipMsRoute* route;
+
+   if(
+      PURPLE_CONV_TYPE_IM != purple_conversation_get_type( conv ) ||
+      !voipms_route_is_ours( purple_conversation_get_account( conv ) )
+   ) {
+      return;
+   }
+
+   route = voipms_route_get( purple_conversation_get_name( conv ), TRUE );
+   if( NULL != route && NULL == g_slist_find( route->conversations, conv ) ) {
+      route->conversations = g_slist_prepend( route->conversations, conv );
+   }
+}
+
+static void voipms_route_conversation_deleting(
+   PurpleConversation* conv, gpointer data
+) {
+   struct VoipMsRoute* route;
+
+   route = voipms_route_get( purple_conversation_get_name( conv ), FALSE );
+   if( NULL == route ) {
+      return;
+   }
+   route->conversations = g_slist_remove( route->conversations, conv );
+   voipms_route_done( purple_conversation_get_name( conv ), route );
+}
+
+static void voipms_route_signed_on( PurpleAccount* acct, gpointer data ) {
+   struct VoipMsAccount* proto_data;
+
+   if( !voipms_route_is_ours( acct ) ) {
+      return;
+   }
+   proto_data = acct->gc->proto_data;
+
+   voipms_route_account( acct, proto_data->session->send_did );
+}
+
+static void voipms_route_signed_off( PurpleAccount* acct, gpointer data ) {
+   struct VoipMsRoute* route;
+   GHashTableIter iter;
+
+   if( !voipms_route_is_ours( acct ) || NULL == _voipms_routes ) {
+      return;
+   }
+
+   /* The DID may have changed since it signed on, so look for it. */
+   g_hash_table_iter_init( &iter, _voipms_routes );
+   while( g_hash_table_iter_next( &iter, NULL, (gpointer*)&route ) ) {
+      if( acct != route->account ) {
+         continue;
+      }
+      route->account = NULL;
+      if( NULL == route->conversations ) {
+         g_hash_table_iter_remove( &iter );
+      }
+   }
+}
+
+/* History */
+
+static void voipms_history_free( gpointer data ) {
+   struct VoipMsHistory* history = (struct VoipMsHistory*)data;
+
+   g_free( history->contact );
+   g_list_free_full( history->messages, voipms_message_free );
+   g_list_free( history->fetched );
+   g_hash_table_destroy( history->ids );
+   free( history );
+}
+
+static void voipms_history_write(
+   PurpleAccount* acct, struct VoipMsHistory* history, GList* messages
+) {
+   PurpleConversation* conv;
    struct VoipMsMessage* message;
-   const gchar* date;
+   gchar* escaped;
+   GList* iter;
 
-   /* Parse/translate message metadata. */
-   message = calloc( 1, sizeof( struct VoipMsMessage ) );
-   message_json = json_node_get_object( element_node );
-   message->id =
-      g_strdup( json_object_get_string_member( message_json, "id" ) );
-   date = json_object_get_string_member( message_json, "date" );
-   message->contact = 
-      g_strdup( json_object_get_string_member( message_json, "contact" ) );
-   message->message = 
-      g_strdup( json_object_get_string_member( message_json, "message" ) );
-   message->account = gcfdata->account;
-   strptime( date, "%Y-%m-%d %H:%M:%S", &(message->timeinfo) );
+   conv = purple_find_conversation_with_account(
+      PURPLE_CONV_TYPE_IM, history->contact, acct
+   );
+   if( NULL == conv ) {
+      return;
+   }
 
-   gcfdata->messages = g_list_append( gcfdata->messages, message );
+   for( iter = messages; NULL != iter; iter = g_list_next( iter ) ) {
+      message = (struct VoipMsMessage*)iter->data;
+      escaped = g_markup_escape_text( message->message, -1 );
+      purple_conversation_write(
+         conv,
+         message->outgoing ? acct->username : message->contact,
+         escaped,
+         (message->outgoing ? PURPLE_MESSAGE_SEND : PURPLE_MESSAGE_RECV) |
+            PURPLE_MESSAGE_NO_LOG | PURPLE_MESSAGE_DELAYED,
+         voipms_message_time( message )
+      );
+      g_free( escaped );
+   }
 }
 
-static gboolean voipms_messages_timer( PurpleAccount* acct ) {
-   time_t to_rawtime,
-      from_rawtime;
-   struct tm* to_timeinfo,
-      * from_timeinfo;
+static void voipms_history_fetch_page(
+   PurpleAccount* acct, struct VoipMsHistory* history
+) {
    char from_filter_date[VOIPMS_DATE_BUFFER_SIZE] = { 0 },
-      to_filter_date[VOIPMS_DATE_BUFFER_SIZE] = { 0 };
+      to_filter_date[VOIPMS_DATE_BUFFER_SIZE] = { 0 },
+      limit[VOIPMS_DATE_BUFFER_SIZE] = { 0 };
+   time_t from_rawtime = history->page_to -
+      (VOIPMS_DAY_SECONDS * VOIPMS_HISTORY_PAGE_DAYS);
    GSList* api_args = NULL;
    struct VoipMsAccount* proto_data = acct->gc->proto_data;
+   gchar* contact;
+
+   strftime(
+      from_filter_date, VOIPMS_DATE_BUFFER_SIZE, "%F",
+      localtime( &from_rawtime )
+   );
+   strftime(
+      to_filter_date, VOIPMS_DATE_BUFFER_SIZE, "%F",
+      localtime( &(history->page_to) )
+   );
+   g_snprintf(
+      limit, VOIPMS_DATE_BUFFER_SIZE, "%d",
+      purple_account_get_int(
+         acct, "history_limit", VOIPMS_HISTORY_DEFAULT_LIMIT
+      ) - g_hash_table_size( history->ids )
+   );
 
-   /* Calculate as wide a range as the API will allow us. */
-   /* TODO: Use glib functions for this? */
-   time( &from_rawtime );
-   from_rawtime -= VOIPMS_DAY_SECONDS * VOIPMS_MAX_AGE_DAYS;
-   from_timeinfo = localtime( &from_rawtime );
-   strftime( from_filter_date, VOIPMS_DATE_BUFFER_SIZE, "%F", from_timeinfo );
+   /* The next page picks up the day before this one starts. */
+   history->page_to = from_rawtime - VOIPMS_DAY_SECONDS;
+   history->fetching = TRUE;
 
-   time( &to_rawtime );
-   to_timeinfo = localtime( &to_rawtime );
-   strftime( to_filter_date, VOIPMS_DATE_BUFFER_SIZE, "%F", to_timeinfo );
+   /* Leave out the type so that sent messages come back, too. */
+   api_args = voipms_api_args_add( api_args, "from", from_filter_date );
+   api_args = voipms_api_args_add( api_args, "to", to_filter_date );
+   api_args = voipms_api_args_add(
+      api_args, "did", proto_data->session->send_did
+   );
+   contact = voipms_dialable( history->contact );
+   api_args = voipms_api_args_add( api_args, "contact", contact );
+   g_free( contact );
+   api_args = voipms_api_args_add( api_args, "limit", limit );
 
-   /* Build and send the API request. */
-   api_args = g_slist_append(
-      api_args,
-      g_strdup_printf( "from=%s", from_filter_date )
-   );
-   api_args = g_slist_append( 
-      api_args,
-      g_strdup_printf(
-         "to=%s", to_filter_date
+   purple_debug_info(
+      "voipms", "Fetching history page ending %s...\n", to_filter_date
+   );
+   voipms_api_request(
+      proto_data->session, VOIPMS_METHOD_GETSMS, api_args, history
+   );
+}
+
+static void voipms_history_page_done(
+   PurpleAccount* acct, struct VoipMsHistory* history,
+   struct GcFuncDataMessageList* message_list, gboolean success
+) {
+   struct VoipMsMessage* message;
+   GList* iter,
+      * next;
+   time_t oldest;
+
+   /* Take the messages we haven't seen yet out of the response. */
+   for( iter = message_list->messages; NULL != iter; iter = next ) {
+      next = g_list_next( iter );
+      message = (struct VoipMsMessage*)iter->data;
+      if(
+         NULL == message->id ||
+         g_hash_table_contains( history->ids, message->id )
+      ) {
+         continue;
+      }
+      g_hash_table_add( history->ids, g_strdup( message->id ) );
+      history->fetched = g_list_prepend( history->fetched, message );
+      message_list->messages =
+         g_list_delete_link( message_list->messages, iter );
+   }
+
+   /* Keep paging back until we have enough or run into the API's limit. */
+   oldest = time( NULL ) - (VOIPMS_DAY_SECONDS * VOIPMS_MAX_AGE_DAYS);
+   if(
+      success &&
+      history->page_to > oldest &&
+      (gint)g_hash_table_size( history->ids ) < purple_account_get_int(
+         acct, "history_limit", VOIPMS_HISTORY_DEFAULT_LIMIT
       )
+   ) {
+      voipms_history_fetch_page( acct, history );
+      return;
+   }
+
+   history->fetching = FALSE;
+   history->fetched =
+      g_list_sort( history->fetched, voipms_message_compare_time );
+   voipms_history_write( acct, history, history->fetched );
+   history->messages = g_list_sort(
+      g_list_concat( history->messages, history->fetched ),
+      voipms_message_compare_time
    );
-   api_args = g_slist_append( api_args, g_strdup( "type=1" ) );
-   api_args = g_slist_append(
-      api_args,
-      g_strdup_printf(
-         "did=%s", purple_account_get_string( acct, "did", "" )
+   history->fetched = NULL;
+}
+
+static void voipms_history_show( PurpleAccount* acct, const char* contact ) {
+   struct VoipMsAccount* proto_data = acct->gc->proto_data;
+   struct VoipMsHistory* history;
+   gchar* number;
+
+   /* Kept by number, so it's the same cache however the contact's written. */
+   number = voipms_canonical( contact );
+   history = g_hash_table_lookup( proto_data->history, number );
+   if( NULL != history ) {
+      g_free( number );
+      /* A fetch in progress writes its messages when it's done. */
+      if( !history->fetching ) {
+         voipms_history_write( acct, history, history->messages );
+      }
+      return;
+   }
+
+   history = calloc( 1, sizeof( struct VoipMsHistory ) );
+   history->contact = number;
+   history->ids = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, NULL );
+   history->page_to = time( NULL );
+   g_hash_table_insert( proto_data->history, history->contact, history );
+
+   voipms_history_fetch_page( acct, history );
+}
+
+static void voipms_history_append(
+   PurpleAccount* acct, struct VoipMsMessage* message
+) {
+   struct VoipMsAccount* proto_data = acct->gc->proto_data;
+   struct VoipMsHistory* history;
+   struct VoipMsMessage* copy;
+   gchar* number;
+
+   /* Only keep caches that a conversation has already asked for. */
+   number = voipms_canonical( message->contact );
+   history = g_hash_table_lookup( proto_data->history, number );
+   g_free( number );
+   if( NULL == history ) {
+      return;
+   }
+
+   if( NULL != message->id ) {
+      if( g_hash_table_contains( history->ids, message->id ) ) {
+         return;
+      }
+      g_hash_table_add( history->ids, g_strdup( message->id ) );
+   }
+
+   copy = calloc( 1, sizeof( struct VoipMsMessage ) );
+   copy->id = g_strdup( message->id );
+   copy->contact = g_strdup( message->contact );
+   copy->message = g_strdup( message->message );
+   copy->timeinfo = message->timeinfo;
+   copy->outgoing = message->outgoing;
+   copy->account = message->account;
+   history->messages = g_list_append( history->messages, copy );
+}
+
+static void voipms_conversation_created(
+   PurpleConversation* conv, gpointer user_data
+) {
+   PurpleAccount* acct = purple_conversation_get_account( conv );
+
+   if(
+      PURPLE_CONV_TYPE_IM != purple_conversation_get_type( conv ) ||
+      strcmp( purple_account_get_protocol_id( acct ), VOIPMS_PLUGIN_ID ) ||
+      !purple_account_is_connected( acct ) ||
+      0 >= purple_account_get_int(
+         acct, "history_limit", VOIPMS_HISTORY_DEFAULT_LIMIT
       )
+   ) {
+      return;
+   }
+
+   voipms_history_show( acct, purple_conversation_get_name( conv ) );
+}
+
+/* Flood */
+
+static void voipms_flood_held_free( gpointer data ) {
+   struct VoipMsFloodHeld* held = (struct VoipMsFloodHeld*)data;
+
+   if( NULL != held->log ) {
+      purple_log_free( held->log );
+   }
+   g_free( held->contact );
+   free( held );
+}
+
+static struct VoipMsFloodHeld* voipms_flood_held_get(
+   PurpleAccount* account, const char* contact, time_t when
+) {
+   struct VoipMsAccount* proto_data = account->gc->proto_data;
+   struct VoipMsFloodHeld* held;
+
+   held = g_hash_table_lookup( proto_data->flood_held, contact );
+   if( NULL == held ) {
+      held = calloc( 1, sizeof( struct VoipMsFloodHeld ) );
+      held->contact = g_strdup( contact );
+      held->log = purple_log_new(
+         PURPLE_LOG_IM, contact, account, NULL, when, NULL
+      );
+      g_hash_table_insert( proto_data->flood_held, held->contact, held );
+   }
+   held->last = MAX( held->last, when );
+   held->touched = g_get_monotonic_time() / G_USEC_PER_SEC;
+
+   return held;
+}
+
+/* Write what would have been shown straight to the contact's log. This is  *
+ * the only place a held message is kept, so it's written whether or not   *
+ * logging is on.                                                          */
+static void voipms_flood_log(
+   PurpleAccount* account, const char* contact, const char* text, time_t when
+) {
+   struct VoipMsFloodHeld* held;
+
+   held = voipms_flood_held_get( account, contact, when );
+   purple_log_write( held->log, PURPLE_MESSAGE_RECV, contact, when, text );
+}
+
+/* Sum up what's been held since the last time. A few contacts get a line in *
+ * their own conversation; any more than that share one notice, so a flood  *
+ * from a lot of numbers can't open a lot of windows. Each contact keeps    *
+ * its log until it's been quiet for a while, so a long flood doesn't start *
+ * a new log file every window.                                             */
+static void voipms_flood_flush( PurpleAccount* acct ) {
+   struct VoipMsAccount* proto_data = acct->gc->proto_data;
+   struct VoipMsFloodHeld* held;
+   GHashTableIter iter;
+   GString* notice;
+   guint contacts = 0,
+      listed = 0,
+      total = 0;
+   gint64 now = g_get_monotonic_time() / G_USEC_PER_SEC;
+   gchar* msg;
+
+   if(
+      NULL == proto_data->flood ||
+      now < proto_data->flood_flushed + VOIPMS_FLOOD_BUCKET_SECONDS
+   ) {
+      return;
+   }
+   proto_data->flood_flushed = now;
+   voipms_flood_prune( proto_data->flood );
+
+   /* Attachments finishing after a summary leave entries with nothing new. */
+   g_hash_table_iter_init( &iter, proto_data->flood_held );
+   while( g_hash_table_iter_next( &iter, NULL, (gpointer*)&held ) ) {
+      if( 0 < held->count ) {
+         contacts++;
+         total += held->count;
+      }
+   }
+   if( 0 == contacts ) {
+      goto flood_flush_cleanup;
+   }
+
+   purple_debug_warning(
+      "voipms", "Held %u incoming message(s) from %u contact(s).\n",
+      total, contacts
    );
 
-   /* Don't pile on getSMS requests. */
-   if( !proto_data->requests_in_progress ) {
-      purple_debug_info( "voipms", "Polling the server for messages...\n" );
-      voipms_api_request( VOIPMS_METHOD_GETSMS, api_args, acct, NULL );
+   notice = g_string_new( NULL );
+   g_hash_table_iter_init( &iter, proto_data->flood_held );
+   while( g_hash_table_iter_next( &iter, NULL, (gpointer*)&held ) ) {
+      if( 0 == held->count ) {
+         continue;
+      }
+
+      if( VOIPMS_FLOOD_MAX_SUMMARIES >= contacts ) {
+         msg = g_strdup_printf(
+            "%u more message(s) arrived too quickly to show. They were "
+               "saved to the log instead.",
+            held->count
+         );
+         serv_got_im(
+            acct->gc, held->contact, msg,
+            PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_SYSTEM, held->last
+         );
+         g_free( msg );
+      } else if( VOIPMS_FLOOD_MAX_LISTED > listed++ ) {
+         g_string_append_printf(
+            notice, "%s: %u\n", held->contact, held->count
+         );
+      }
+   }
+
+   if( VOIPMS_FLOOD_MAX_LISTED < listed ) {
+      g_string_append_printf(
+         notice, "...and %u more contact(s).\n",
+         listed - VOIPMS_FLOOD_MAX_LISTED
+      );
+   }
+   if( 0 < notice->len ) {
+      msg = g_strdup_printf(
+         "%u message(s) from %u contacts were saved to each contact's log.",
+         total, contacts
+      );
+      purple_notify_info(
+         acct->gc, "Incoming Messages Held", msg, notice->str
+      );
+      g_free( msg );
+   }
+   g_string_free( notice, TRUE );
+
+flood_flush_cleanup:
+
+   g_hash_table_iter_init( &iter, proto_data->flood_held );
+   while( g_hash_table_iter_next( &iter, NULL, (gpointer*)&held ) ) {
+      if( now >= held->touched + VOIPMS_FLOOD_HELD_IDLE_SECONDS ) {
+         g_hash_table_iter_remove( &iter );
+      } else {
+         held->count = 0;
+      }
+   }
+}
+
+static void messages_foreach_serve( gpointer data, gpointer user_data ) {
+   struct VoipMsMessage* message = (struct VoipMsMessage*)data;
+   struct GcFuncDataMessageList* message_list =
+      (struct GcFuncDataMessageList*)user_data;
+   PurpleAccount* account = (PurpleAccount*)message->account;
+   struct VoipMsAccount* proto_data = account->gc->proto_data;
+   GSList* api_args = NULL;
+   struct VoipMsMms* mms;
+   GList* media_iter;
+   int media_index = 0;
+   gboolean held;
+   struct tm sent;
+
+   /* Over the flood limits, the message goes to the log to be summed up    *
+    * later, rather than into a conversation of its own.                    */
+   held = NULL != proto_data->flood &&
+      !voipms_flood_admit( proto_data->flood, message->contact );
+   if( held ) {
+      voipms_flood_held_get(
+         account, message->contact, voipms_message_time( message )
+      )->count++;
+   }
+   /* Replayed messages aren't on the server, so polls mustn't skip them. */
+   if( !message_list->replayed ) {
+      sent = message->timeinfo;
+      voipms_snapshot_touch(
+         proto_data->snapshot, message->contact, mktime( &sent )
+      );
+      proto_data->session->poll_since = proto_data->snapshot->high_water;
+   }
+   voipms_trace(
+      held ? VOIPMS_TRACE_HELD : VOIPMS_TRACE_RECEIVED,
+      message->mms ? VOIPMS_METHOD_GETMMS : VOIPMS_METHOD_GETSMS, 0, 0,
+      strlen( message->message ),
+      0, NULL == message->id ? 0 : g_ascii_strtoull( message->id, NULL, 10 )
+   );
+
+   /* Pass the message on to the user. Picture messages may not have any     *
+    * text at all.                                                           */
+   if( !message->mms || '\0' != message->message[0] ) {
+      if( held ) {
+         voipms_flood_log(
+            account, message->contact, message->message,
+            voipms_message_time( message )
+         );
+      } else {
+         serv_got_im(
+            account->gc,
+            message->contact,
+            message->message,
+            PURPLE_MESSAGE_RECV,
+            voipms_message_time( message )
+         );
+      }
+      voipms_history_append( account, message );
+   }
+
+   /* Replayed messages aren't on the server, so leave it alone. */
+   if( message_list->replayed ) {
+      goto messages_serve_cleanup;
+   }
+
+   if( message->mms ) {
+      /* The attachments are delivered as they finish downloading, and the   *
+       * message is deleted after the last of them.                          */
+      mms = calloc( 1, sizeof( struct VoipMsMms ) );
+      mms->id = g_strdup( message->id );
+      mms->contact = g_strdup( message->contact );
+      mms->time = voipms_message_time( message );
+      mms->account = account;
+      mms->relayed = message_list->relayed;
+      mms->held = held;
+
+      /* Hold a reference of our own so a download failing right away can't  *
+       * finish the message off before the rest have started.                */
+      mms->pending++;
+      for(
+         media_iter = message->media;
+         NULL != media_iter;
+         media_iter = g_list_next( media_iter )
+      ) {
+         voipms_media_request(
+            account, mms, media_iter->data, media_index++
+         );
+      }
+      mms->pending--;
+
+      if( 0 == mms->pending ) {
+         voipms_mms_free( mms );
+      }
+      goto messages_serve_cleanup;
+   }
+
+   /* Delete the message from the server, unless the relay's doing that. */
+   if(
+      message_list->relayed ||
+      !purple_account_get_bool( account, "delete", TRUE )
+   ) {
+      goto messages_serve_cleanup;
+   }
+
+   /* Build and send the API request. It's picked up by the next progress    *
+    * check, so there's no need to wait on it here.                          */
+   api_args = voipms_api_args_add( api_args, "id", message->id );
+
+   voipms_api_request(
+      proto_data->session, VOIPMS_METHOD_DELETESMS, api_args, NULL
+   );
+
+messages_serve_cleanup:
+
+   return;
+}
+
+static gboolean voipms_messages_timer( PurpleAccount* acct ) {
+   struct VoipMsAccount* proto_data = acct->gc->proto_data;
+
+   if( NULL == proto_data->replay ) {
+      voipms_session_poll(
+         proto_data->session, purple_account_get_bool( acct, "mms", TRUE )
+      );
    }
 
    /* Check on all the requests so far. */
-   voipms_api_request_progress( acct );
+   voipms_api_request_progress( proto_data->session );
+
+   voipms_flood_flush( acct );
+
+   /* Make the outbox durable once per tick, rather than once per write. */
+   voipms_outbox_sync( proto_data->session );
+   voipms_outbox_pump( proto_data->session );
 
    return TRUE;
 }
@@ -469,18 +1474,80 @@ static void voipms_refresh_buddies( PurpleAccount* acct ) {
          continue;
       }
 
-      purple_prpl_got_user_status(
-         acct,
-         PURPLE_BLIST_NODE_NAME( blist_node ),
-         default_status,
-         NULL
-      );
+      purple_prpl_got_user_status(
+         acct,
+         PURPLE_BLIST_NODE_NAME( blist_node ),
+         default_status,
+         NULL
+      );
+   }
+}
+
+static gboolean voipms_refresh_buddies_timer( PurpleAccount* acct ) {
+   struct VoipMsAccount* proto_data = acct->gc->proto_data;
+
+   proto_data->refresh_timer = 0;
+   voipms_refresh_buddies( acct );
+
+   return FALSE;
+}
+
+/* Set the contacts from the snapshot online straight away; the rest wait  *
+ * for the full walk, which can take a while on a big buddy list.          */
+static void voipms_refresh_recent( PurpleAccount* acct ) {
+   struct VoipMsAccount* proto_data = acct->gc->proto_data;
+   GPtrArray* contacts = proto_data->snapshot->contacts;
+   const char* default_status,
+      * contact;
+   guint i;
+
+   default_status = purple_account_get_string(
+      acct, "default_status", VOIPMS_STATUS_ONLINE
+   );
+
+   for( i = 0; contacts->len > i; i++ ) {
+      contact = g_ptr_array_index( contacts, i );
+      if( NULL != purple_find_buddy( acct, contact ) ) {
+         purple_prpl_got_user_status( acct, contact, default_status, NULL );
+      }
+   }
+}
+
+/* Send from the first SMS-capable DID the account has, unless one was set. *
+ * Polls keep asking about every DID, so none of them go quiet.             */
+static void voipms_snapshot_apply_did( PurpleAccount* acct ) {
+   struct VoipMsAccount* proto_data = acct->gc->proto_data;
+   struct VoipMsSession* session = proto_data->session;
+   const char* did = purple_account_get_string( acct, "did", "" );
+
+   if(
+      (NULL != did && '\0' != did[0]) ||
+      NULL == proto_data->snapshot->dids[0] ||
+      !strcmp( session->send_did, proto_data->snapshot->dids[0] )
+   ) {
+      return;
+   }
+
+   purple_debug_info(
+      "voipms", "Sending from DID %s for %s.\n",
+      proto_data->snapshot->dids[0], acct->username
+   );
+   if( purple_account_is_connected( acct ) ) {
+      voipms_route_account( NULL, session->send_did );
+      voipms_route_account( acct, proto_data->snapshot->dids[0] );
    }
+   g_free( session->send_did );
+   session->send_did = g_strdup( proto_data->snapshot->dids[0] );
 }
 
 static void voipms_login( PurpleAccount* acct ) {
    PurpleConnection* gc = purple_account_get_connection( acct );
    struct VoipMsAccount* vmsa;
+   gchar* path;
+   const char* relay_socket;
+   int budget,
+      flood_contact,
+      flood_account;
 
    /* Setup the protocol data section. */
    vmsa = calloc( 1, sizeof( struct VoipMsAccount ) );
@@ -495,8 +1562,69 @@ static void voipms_login( PurpleAccount* acct ) {
       2  /* Total number of steps. */
    );
 
-   /* Setup the CURL multi handle. */
-   vmsa->multi_handle = curl_multi_init();
+   /* Setup the request engine. */
+   vmsa->session = voipms_session_new(
+      acct->username,
+      acct->password,
+      purple_account_get_string(
+         acct, "api_url", VOIPMS_PLUGIN_DEFAULT_API_URL
+      ),
+      purple_account_get_string( acct, "did", "" ),
+      purple_account_get_bool( acct, "use_post", TRUE )
+   );
+   vmsa->session->complete = voipms_api_request_complete;
+   vmsa->session->cancel = voipms_request_cancel;
+   vmsa->session->user_data = acct;
+   budget = purple_account_get_int( acct, "bandwidth_budget", 0 );
+   if( 0 < budget ) {
+      voipms_session_set_budget( vmsa->session, (guint64)budget * 1024 );
+   }
+
+   vmsa->history = g_hash_table_new_full(
+      g_str_hash, g_str_equal, NULL, voipms_history_free
+   );
+
+   flood_contact = purple_account_get_int(
+      acct, "flood_contact", VOIPMS_FLOOD_DEFAULT_CONTACT
+   );
+   flood_account = purple_account_get_int(
+      acct, "flood_account", VOIPMS_FLOOD_DEFAULT_ACCOUNT
+   );
+   if( 0 < flood_contact || 0 < flood_account ) {
+      vmsa->flood = voipms_flood_new(
+         MAX( 0, flood_contact ), MAX( 0, flood_account )
+      );
+   }
+   vmsa->flood_held = g_hash_table_new_full(
+      g_str_hash, g_str_equal, NULL, voipms_flood_held_free
+   );
+
+   /* Start from where the last session left off. It's refreshed in the  *
+    * background, so a missing or stale snapshot only costs a slower start. */
+   path = voipms_account_path( acct, "snapshot", "vmssnp" );
+   vmsa->snapshot = voipms_snapshot_load( path );
+   g_free( path );
+   if( NULL == vmsa->snapshot ) {
+      vmsa->snapshot = voipms_snapshot_new();
+   }
+   voipms_snapshot_apply_did( acct );
+   vmsa->session->poll_since = vmsa->snapshot->high_water;
+
+   path = voipms_account_path( acct, "outbox", "log" );
+   voipms_outbox_open( vmsa->session, path );
+   g_free( path );
+
+   if( purple_account_get_bool( acct, "capture", FALSE ) ) {
+      path = voipms_capture_path( acct );
+      voipms_capture_open( vmsa->session, path );
+      g_free( path );
+   }
+
+   /* Let a shared relay do the polling and deleting, if there is one. */
+   relay_socket = purple_account_get_string( acct, "relay_socket", "" );
+   if( NULL != relay_socket && '\0' != relay_socket[0] ) {
+      voipms_relay_open( vmsa->session, relay_socket );
+   }
  
    purple_connection_update_progress(
       gc,
@@ -507,9 +1635,20 @@ static void voipms_login( PurpleAccount* acct ) {
 
    purple_connection_set_state( gc, PURPLE_CONNECTED );
  
-   voipms_refresh_buddies( gc->account );
+   voipms_refresh_recent( acct );
+   vmsa->refresh_timer = purple_timeout_add(
+      0, (GSourceFunc)voipms_refresh_buddies_timer, acct
+   );
+
+   /* Check the account's DIDs, for next time and for this time if it has  *
+    * no snapshot yet.                                                     */
+   voipms_api_request(
+      vmsa->session, VOIPMS_METHOD_GETDIDSINFO, NULL, NULL
+   );
 
-   /* Start polling for new messages. */
+   /* Start polling for new messages, and don't wait a whole interval for *
+    * the first.                                                          */
+   voipms_messages_timer( acct );
    vmsa->timer = purple_timeout_add_seconds(
       VOIPMS_POLL_SECONDS, (GSourceFunc)voipms_messages_timer, acct
    );
@@ -517,46 +1656,108 @@ static void voipms_login( PurpleAccount* acct ) {
 
 static void voipms_close( PurpleConnection* gc ) {
    struct VoipMsAccount* vmsa = gc->proto_data;
+   gchar* path;
+
+   if( NULL == vmsa ) {
+      return;
+   }
 
    /* Stop polling for new messages. */
    if( vmsa->timer ) {
       purple_timeout_remove( vmsa->timer );
    }
+   if( vmsa->refresh_timer ) {
+      purple_timeout_remove( vmsa->refresh_timer );
+   }
+
+   path = voipms_account_path( gc->account, "snapshot", "vmssnp" );
+   voipms_snapshot_save( vmsa->snapshot, path );
+   g_free( path );
+
+   /* Cancels whatever's still in flight. Nothing completes after this, so *
+    * nothing can touch the account once it's gone.                         */
+   voipms_session_free( vmsa->session );
+
+   g_hash_table_destroy( vmsa->history );
+   g_hash_table_destroy( vmsa->flood_held );
+   if( NULL != vmsa->flood ) {
+      voipms_flood_free( vmsa->flood );
+   }
+   if( NULL != vmsa->replay ) {
+      voipms_replay_free( vmsa->replay );
+   }
+   voipms_snapshot_free( vmsa->snapshot );
+
+   free( vmsa );
+   gc->proto_data = NULL;
+}
+
+static void voipms_send_im_data_free( struct VoipMsSendImData* send_im_data ) {
+   g_free( send_im_data->who );
+   free( send_im_data );
+}
+
+static GSList* voipms_message_find_images( const char* message ) {
+   const char* start,
+      * end,
+      * search = message,
+      * id;
+   GData* attribs;
+   GSList* images = NULL;
+   PurpleStoredImage* image;
+
+   /* Pidgin hands us inline images as <img id="..."> tags. */
+   while(
+      VOIPMS_MMS_MAX_MEDIA > g_slist_length( images ) &&
+      purple_markup_find_tag( "img", search, &start, &end, &attribs )
+   ) {
+      id = g_datalist_get_data( &attribs, "id" );
+      if( NULL != id ) {
+         image = purple_imgstore_find_by_id( atoi( id ) );
+         if( NULL != image ) {
+            images = g_slist_append( images, image );
+         }
+      }
+      g_datalist_clear( &attribs );
+      search = end + 1;
+   }
 
-   /* Shut down CURL. */
-   curl_multi_cleanup( vmsa->multi_handle );
+   return images;
 }
 
 static int voipms_send_im(
    PurpleConnection* gc, const char* who, const char* message,
    PurpleMessageFlags flags
 ) {
-   const char* from_username = gc->account->username;
-   PurpleMessageFlags receive_flags = 
-      ((flags & ~PURPLE_MESSAGE_SEND) | PURPLE_MESSAGE_RECV);
-   PurpleAccount* to_acct = purple_accounts_find( who, VOIPMS_PLUGIN_ID );
-   PurpleConnection* to;
+   struct VoipMsAccount* proto_data = gc->proto_data;
+   struct VoipMsRoute* route = voipms_route_get( who, FALSE );
+   PurpleAccount* to_acct = NULL != route ? route->account : NULL;
    int retval = 1;
    char* msg;
-   gchar* api_message = NULL;
+   gchar* api_message = NULL,
+      * dst = NULL;
    GSList* api_args = NULL;
-   struct VoipMsSendImData send_im_data = { 0 };
-
-   purple_debug_info(
-      "voipms",
-      "Sending message from %s to %s: %s\n",
-      from_username, who, message
-   );
-
-   /* Is the sender blocked by the recipient's privacy settings? */
-   if( to_acct && !purple_privacy_check( to_acct, gc->account->username ) ) {
+   struct VoipMsSendImData* send_im_data = NULL;
+   struct VoipMsMessage sent_message = { 0 };
+   time_t now;
+   GSList* images = NULL,
+      * image_iter;
+   gchar media_key[16];
+   int media_index = 1;
+
+   /* Is the sender blocked by the recipient's privacy settings? That's   *
+    * only known if the recipient is one of our own DIDs.                  */
+   if(
+      NULL != to_acct &&
+      !purple_privacy_check( to_acct, proto_data->session->send_did )
+   ) {
       msg = g_strdup_printf(
          "Your message was blocked by %s's privacy settings.", who
       );
       purple_debug_info(
          "voipms",
          "Discarding; %s is blocked by %s's privacy settings.\n",
-         from_username,
+         proto_data->session->send_did,
          who
       );
       purple_conv_present_error( who, gc->account, msg );
@@ -565,82 +1766,84 @@ static int voipms_send_im(
       goto send_im_cleanup;
    }
 
-   /* Strip the whitespace from the ends of the string. Useful in case we     *
-    * have something like OTR installed.                                      */
-   /* TODO: Encode ~ for URL, somehow. */
-   api_message = g_strdup( purple_url_encode( message ) );
-   api_message = str_replace( api_message, "~", "-" );
-   g_strstrip( api_message );
+   /* Send to the dialable form, so "555 123 4567" goes out as 5551234567.  *
+    * Anything that still isn't something the outbox can write down is      *
+    * turned away below. Encoding happens when the request body is built.    */
+   dst = g_strstrip( voipms_dialable( who ) );
+   images = voipms_message_find_images( message );
+   if( NULL == images ) {
+      /* Plain text goes through the outbox, which keeps it on disk until    *
+       * the API has taken it and retries on its own if the API is down.     */
+      api_message = g_strstrip( g_strdup( message ) );
+      if( !voipms_outbox_add( proto_data->session, dst, api_message ) ) {
+         msg = g_strdup_printf( "Unable to send to %s.", who );
+         purple_conv_present_error( who, gc->account, msg );
+         g_free( msg );
+         retval = -1;
+         goto send_im_cleanup;
+      }
+      voipms_trace(
+         VOIPMS_TRACE_SENT, VOIPMS_METHOD_SENDSMS, 0, 0,
+         strlen( api_message ), 0, 0
+      );
+      voipms_outbox_pump( proto_data->session );
+      goto send_im_sent;
+   }
 
-   purple_debug_info(
-      "voipms",
-      "Encoded message: %s\n",
-      api_message
-   );
+   /* Inline images go out as MMS, with the markup taken out of the text.    *
+    * The images only live in the image store, so these aren't queued.       */
+   api_message = g_strstrip( purple_markup_strip_html( message ) );
 
    /* Build and send the API request. */
-   api_args = g_slist_append(
-      api_args,
-      g_strdup_printf(
-         "did=%s", purple_account_get_string( gc->account, "did", "" )
-      )
-   );
-   api_args = g_slist_append(
-      api_args,
-      g_strdup_printf(
-         "dst=%s", purple_url_encode( who )
-      )
+   api_args = voipms_api_args_add(
+      api_args, "did", proto_data->session->send_did
    );
-   api_args = g_slist_append(
-      api_args,
-      g_strdup_printf(
-         "message=%s", api_message
-      )
+   api_args = voipms_api_args_add( api_args, "dst", dst );
+   api_args = voipms_api_args_add( api_args, "message", api_message );
+   for(
+      image_iter = images;
+      NULL != image_iter;
+      image_iter = g_slist_next( image_iter )
+   ) {
+      g_snprintf( media_key, sizeof( media_key ), "media%d", media_index++ );
+      api_args =
+         voipms_api_args_add_image( api_args, media_key, image_iter->data );
+   }
+   g_slist_free( images );
+
+   /* Build the attachment. The request reports its own failure, if any,    *
+    * once it's done, so we don't have to wait for it here.                  */
+   send_im_data = calloc( 1, sizeof( struct VoipMsSendImData ) );
+   send_im_data->who = g_strdup( who );
+   voipms_trace(
+      VOIPMS_TRACE_SENT, VOIPMS_METHOD_SENDMMS, 0, 0,
+      strlen( api_message ), 0, media_index - 1
    );
 
-   /* Build the attachment. */
-
    voipms_api_request(
-      VOIPMS_METHOD_SENDSMS, api_args, gc->account, &send_im_data
+      proto_data->session, VOIPMS_METHOD_SENDMMS, api_args, send_im_data
    );
 
-   /* Block until request completes. */
-   while( !send_im_data.processed ) {
-      voipms_api_request_progress( gc->account );
-      /* TODO: Delay for a second or so. */
-   }
-
-   /* Return success or fail based on response. */
-   if( !send_im_data.success ) {
-      msg = g_strdup_printf(
-         "There was a problem contacting the VOIP.ms API: %s",
-         send_im_data.error_buffer
-      );
-      purple_debug_error(
-         "voipms",
-         "Discarding; there was a problem contacting the VOIP.ms API.\n"
-      );
-      purple_conv_present_error( who, gc->account, msg );
-      g_free( msg );
-      retval = 0;
-      goto send_im_cleanup;
-   }
+send_im_sent:
 
-   to = get_voipms_gc( who );
-   if( to ) {
-      /* TODO: Fix timezone? */
-      serv_got_im( to, from_username, message, receive_flags, time( NULL ) );
-   }
+   /* Keep the contact's history cache in step, if there is one. Back out   *
+    * the offset that voipms_message_time() will add to it.                 */
+   now = time( NULL ) -
+      (purple_account_get_int( gc->account, "hours_offset", 0 ) * 60 * 60);
+   sent_message.contact = (gchar*)who;
+   sent_message.message = api_message;
+   sent_message.outgoing = TRUE;
+   sent_message.account = gc->account;
+   localtime_r( &now, &(sent_message.timeinfo) );
+   voipms_history_append( gc->account, &sent_message );
+   voipms_snapshot_touch( proto_data->snapshot, who, 0 );
 
 send_im_cleanup:
    
    if( NULL != api_message ) {
       g_free( api_message );
    }
-
-   if( NULL != send_im_data.error_buffer ) {
-      g_free( send_im_data.error_buffer );
-   }
+   g_free( dst );
 
    return retval;
 }
@@ -705,8 +1908,301 @@ static const char* voipms_list_icon( PurpleAccount* acct, PurpleBuddy* buddy ) {
    return "voipms";
 }
 
+/* Bulk */
+
+static void voipms_bulk_report_free( gpointer data ) {
+   struct VoipMsBulkReport* report = (struct VoipMsBulkReport*)data;
+
+   g_free( report->conv_name );
+   free( report );
+}
+
+/* Progress goes to the conversation the bulk was started from, if any,    *
+ * every tenth of the way; the summary goes there or to a notification.    */
+static void voipms_bulk_progress(
+   struct VoipMsSession* session, struct VoipMsBulk* bulk
+) {
+   struct VoipMsBulkReport* report = (struct VoipMsBulkReport*)bulk->user_data;
+   PurpleConversation* conv = NULL;
+   guint finished = bulk->sent + bulk->failed,
+      step = MAX( 1, bulk->count / 10 );
+   gchar* msg;
+
+   if( NULL != report->conv_name ) {
+      conv = purple_find_conversation_with_account(
+         PURPLE_CONV_TYPE_IM, report->conv_name, report->account
+      );
+   }
+
+   if( voipms_bulk_is_done( bulk ) ) {
+      msg = voipms_bulk_summary( bulk );
+      purple_debug_info( "voipms", "Bulk send finished: %s\n", msg );
+      if( NULL != conv ) {
+         purple_conversation_write(
+            conv, NULL, msg, PURPLE_MESSAGE_SYSTEM, time( NULL )
+         );
+      } else {
+         purple_notify_info(
+            report->account->gc, "Bulk Send", "Bulk send finished.", msg
+         );
+      }
+      g_free( msg );
+      return;
+   }
+
+   if( finished < report->reported + step ) {
+      return;
+   }
+   report->reported = finished;
+
+   msg = g_strdup_printf(
+      "Bulk send: %u of %u done, %u failed so far.",
+      finished, bulk->count, bulk->failed
+   );
+   purple_debug_info( "voipms", "%s\n", msg );
+   if( NULL != conv ) {
+      purple_conversation_write(
+         conv, NULL, msg, PURPLE_MESSAGE_SYSTEM, time( NULL )
+      );
+   }
+   g_free( msg );
+}
+
+/* Each word is a number, or the name of a buddy group to send to all of. */
+static gchar** voipms_bulk_recipients(
+   PurpleAccount* acct, const char* recipients
+) {
+   GPtrArray* numbers;
+   PurpleBlistNode* blist_node;
+   PurpleBuddy* buddy;
+   PurpleGroup* group;
+   gchar** words;
+   int i;
+
+   numbers = g_ptr_array_new();
+   words = g_strsplit_set( recipients, ",; \t\r\n", -1 );
+   for( i = 0; NULL != words[i]; i++ ) {
+      if( '\0' == words[i][0] ) {
+         continue;
+      }
+
+      group = purple_find_group( words[i] );
+      if( NULL == group ) {
+         g_ptr_array_add( numbers, voipms_dialable( words[i] ) );
+         continue;
+      }
+
+      for(
+         blist_node = purple_blist_get_root();
+         NULL != blist_node;
+         blist_node = purple_blist_node_next( blist_node, FALSE )
+      ) {
+         if( !PURPLE_BLIST_NODE_IS_BUDDY( blist_node ) ) {
+            continue;
+         }
+         buddy = (PurpleBuddy*)blist_node;
+         if(
+            acct == purple_buddy_get_account( buddy ) &&
+            group == purple_buddy_get_group( buddy )
+         ) {
+            g_ptr_array_add(
+               numbers, voipms_dialable( purple_buddy_get_name( buddy ) )
+            );
+         }
+      }
+   }
+   g_strfreev( words );
+
+   g_ptr_array_add( numbers, NULL );
+   return (gchar**)g_ptr_array_free( numbers, FALSE );
+}
+
+static gboolean voipms_bulk_send(
+   PurpleAccount* acct, const char* recipients, const char* message,
+   guint concurrency, guint rate, const char* conv_name
+) {
+   struct VoipMsAccount* proto_data = acct->gc->proto_data;
+   struct VoipMsBulkReport* report;
+   gchar** numbers,
+      * api_message;
+
+   numbers = voipms_bulk_recipients( acct, recipients );
+   if( NULL == numbers[0] || NULL == message || '\0' == message[0] ) {
+      g_strfreev( numbers );
+      return FALSE;
+   }
+
+   report = calloc( 1, sizeof( struct VoipMsBulkReport ) );
+   report->account = acct;
+   report->conv_name = g_strdup( conv_name );
+
+   /* Same as a single IM: the API takes plain text. */
+   api_message = purple_unescape_html( message );
+   voipms_bulk_start(
+      proto_data->session, numbers, api_message, concurrency, rate,
+      voipms_bulk_progress, report, voipms_bulk_report_free
+   );
+   g_free( api_message );
+   g_strfreev( numbers );
+
+   return TRUE;
+}
+
+static PurpleCmdRet voipms_bulk_cmd(
+   PurpleConversation* conv, const gchar* cmd, gchar** args, gchar** error,
+   void* data
+) {
+   PurpleAccount* acct = purple_conversation_get_account( conv );
+
+   if(
+      !voipms_bulk_send(
+         acct, args[0], args[1], 0, 0, purple_conversation_get_name( conv )
+      )
+   ) {
+      *error = g_strdup( "Nobody to send to, or nothing to send." );
+      return PURPLE_CMD_RET_FAILED;
+   }
+
+   return PURPLE_CMD_RET_OK;
+}
+
+static void voipms_bulk_request_ok(
+   PurpleConnection* gc, PurpleRequestFields* fields
+) {
+   if(
+      !voipms_bulk_send(
+         gc->account,
+         purple_request_fields_get_string( fields, "recipients" ),
+         purple_request_fields_get_string( fields, "message" ),
+         MAX( 0, purple_request_fields_get_integer( fields, "concurrency" ) ),
+         MAX( 0, purple_request_fields_get_integer( fields, "rate" ) ),
+         NULL
+      )
+   ) {
+      purple_notify_error(
+         gc, "Bulk Send", "Unable to start bulk send.",
+         "Nobody to send to, or nothing to send."
+      );
+   }
+}
+
+static void voipms_action_bulk( PurplePluginAction* action ) {
+   PurpleConnection* gc = (PurpleConnection*)action->context;
+   PurpleRequestFields* fields;
+   PurpleRequestFieldGroup* group;
+   PurpleRequestField* field;
+
+   fields = purple_request_fields_new();
+   group = purple_request_field_group_new( NULL );
+   purple_request_fields_add_group( fields, group );
+
+   field = purple_request_field_string_new(
+      "recipients", "Numbers or Buddy Groups", NULL, TRUE
+   );
+   purple_request_field_set_required( field, TRUE );
+   purple_request_field_group_add_field( group, field );
+
+   field = purple_request_field_string_new( "message", "Message", NULL, TRUE );
+   purple_request_field_set_required( field, TRUE );
+   purple_request_field_group_add_field( group, field );
+
+   field = purple_request_field_int_new(
+      "concurrency", "Sends at Once", VOIPMS_BULK_DEFAULT_CONCURRENCY
+   );
+   purple_request_field_group_add_field( group, field );
+
+   field = purple_request_field_int_new(
+      "rate", "Sends per Second", VOIPMS_BULK_DEFAULT_RATE
+   );
+   purple_request_field_group_add_field( group, field );
+
+   purple_request_fields(
+      gc, "Send Bulk Message", "Send one message to many numbers",
+      "Separate numbers with commas or new lines. A buddy group's name sends "
+      "to everyone in it. You'll get a summary once they've all gone.",
+      fields,
+      "Send", G_CALLBACK( voipms_bulk_request_ok ),
+      "Cancel", NULL,
+      gc->account, NULL, NULL, gc
+   );
+}
+
+static void voipms_action_traffic( PurplePluginAction* action ) {
+   PurpleConnection* gc = (PurpleConnection*)action->context;
+   struct VoipMsAccount* proto_data = gc->proto_data;
+   struct VoipMsTraffic* traffic = &(proto_data->session->traffic);
+   gchar* summary,
+      * budget;
+   guint delay;
+
+   delay = voipms_session_poll_delay( proto_data->session );
+   if( 0 == proto_data->session->budget ) {
+      budget = g_strdup( "" );
+   } else if( 0 < delay ) {
+      budget = g_strdup_printf(
+         "\nBudget: %" G_GUINT64_FORMAT " KB/hour; polling again in %u "
+            "seconds.",
+         proto_data->session->budget / 1024, delay
+      );
+   } else {
+      budget = g_strdup_printf(
+         "\nBudget: %" G_GUINT64_FORMAT " KB/hour; polling normally.",
+         proto_data->session->budget / 1024
+      );
+   }
+
+   summary = g_strdup_printf(
+      "Requests: %" G_GUINT64_FORMAT "\n"
+      "Sent: %" G_GUINT64_FORMAT " KB\n"
+      "Received: %" G_GUINT64_FORMAT " KB "
+         "(%" G_GUINT64_FORMAT " KB decompressed)%s",
+      traffic->requests,
+      traffic->sent / 1024,
+      traffic->received / 1024,
+      traffic->decoded / 1024,
+      budget
+   );
+   purple_notify_info(
+      gc, "Traffic Statistics", "Traffic since connecting", summary
+   );
+   g_free( summary );
+   g_free( budget );
+}
+
+static GList* voipms_actions( PurplePlugin* plugin, gpointer context ) {
+   GList* actions = NULL;
+
+   actions = g_list_append(
+      actions,
+      purple_plugin_action_new(
+         "Replay Captured Traffic...", voipms_action_replay
+      )
+   );
+
+   actions = g_list_append(
+      actions,
+      purple_plugin_action_new( "Send Bulk Message...", voipms_action_bulk )
+   );
+
+   actions = g_list_append(
+      actions,
+      purple_plugin_action_new(
+         "Show Traffic Statistics", voipms_action_traffic
+      )
+   );
+
+   actions = g_list_append(
+      actions,
+      purple_plugin_action_new(
+         "Save Flight Recorder", voipms_action_trace
+      )
+   );
+
+   return actions;
+}
+
 static PurplePluginProtocolInfo prpl_info = {
-   0,                               /* options */
+   OPT_PROTO_IM_IMAGE,                 /* options */
    NULL,                               /* user_splits */
    NULL,               /* protocol_options, initialized in voipms_init() */
    {   /* icon_spec, a PurpleBuddyIconSpec */
@@ -760,7 +2256,7 @@ static PurplePluginProtocolInfo prpl_info = {
    NULL,                               /* rename_group */
    NULL,                               /* buddy_free */
    NULL,                               /* convo_closed */
-   NULL,                               /* normalize */
+   voipms_normalize,                   /* normalize */
    NULL,                               /* set_buddy_icon */
    NULL,                               /* remove_group */
    NULL,                               /* get_cb_real_name */
@@ -806,13 +2302,13 @@ static PurplePluginInfo info = {
    VOIPMS_PLUGIN_NAME,                                      /* description */
    NULL,                                                    /* author */
    VOIPMS_PLUGIN_WEBSITE,                                   /* homepage */
-   NULL,                                                    /* load */
-   NULL,                                                    /* unload */
+   voipms_load,                                             /* load */
+   voipms_unload,                                           /* unload */
    voipms_destroy,                                          /* destroy */
    NULL,                                                    /* ui_info */
    &prpl_info,                                              /* extra_info */
    NULL,                                                    /* prefs_info */
-   NULL,                                                    /* actions */
+   voipms_actions,                                          /* actions */
    NULL,                                                    /* padding... */
    NULL,
    NULL,
@@ -825,15 +2321,23 @@ static void voipms_init( PurplePlugin* plugin ) {
    PurpleKeyValuePair* status;
    
    option = purple_account_option_string_new(
-      "REST GET API URL",
+      "REST API URL",
       "api_url",                
       VOIPMS_PLUGIN_DEFAULT_API_URL
    );
    prpl_info.protocol_options =
       g_list_append( prpl_info.protocol_options, option );
 
+   option = purple_account_option_bool_new(
+      "Send Requests as POST",
+      "use_post",
+      TRUE
+   );
+   prpl_info.protocol_options =
+      g_list_append( prpl_info.protocol_options, option );
+
    option = purple_account_option_string_new(
-      "Account DID",
+      "Account DID (Blank to Send from the First with SMS)",
       "did",                
       ""
    );
@@ -874,12 +2378,141 @@ static void voipms_init( PurplePlugin* plugin ) {
    );
    prpl_info.protocol_options =
       g_list_append( prpl_info.protocol_options, option );
+
+   option = purple_account_option_bool_new(
+      "Receive Picture Messages (MMS)",
+      "mms",
+      TRUE
+   );
+   prpl_info.protocol_options =
+      g_list_append( prpl_info.protocol_options, option );
+
+   option = purple_account_option_int_new(
+      "History Messages on Open",
+      "history_limit",
+      VOIPMS_HISTORY_DEFAULT_LIMIT
+   );
+   prpl_info.protocol_options =
+      g_list_append( prpl_info.protocol_options, option );
+
+   option = purple_account_option_bool_new(
+      "Capture API Traffic for Replay",
+      "capture",
+      FALSE
+   );
+   prpl_info.protocol_options =
+      g_list_append( prpl_info.protocol_options, option );
+
+   option = purple_account_option_int_new(
+      "Bandwidth Budget (KB/Hour, 0 for None)",
+      "bandwidth_budget",
+      0
+   );
+   prpl_info.protocol_options =
+      g_list_append( prpl_info.protocol_options, option );
+
+   option = purple_account_option_int_new(
+      "Incoming Limit per Contact (Messages/Minute, 0 for None)",
+      "flood_contact",
+      VOIPMS_FLOOD_DEFAULT_CONTACT
+   );
+   prpl_info.protocol_options =
+      g_list_append( prpl_info.protocol_options, option );
+
+   option = purple_account_option_int_new(
+      "Incoming Limit per Account (Messages/Minute, 0 for None)",
+      "flood_account",
+      VOIPMS_FLOOD_DEFAULT_ACCOUNT
+   );
+   prpl_info.protocol_options =
+      g_list_append( prpl_info.protocol_options, option );
+
+   option = purple_account_option_string_new(
+      "Relay Socket (Blank to Poll Directly)",
+      "relay_socket",
+      ""
+   );
+   prpl_info.protocol_options =
+      g_list_append( prpl_info.protocol_options, option );
  
    purple_debug_info( "voipms", "Starting up...\n" );
 
    _voipms_protocol = plugin;
 }
 
+/* The core logs through glib; pass it on to the debug window. */
+static void voipms_log_handler(
+   const gchar* log_domain, GLogLevelFlags log_level, const gchar* message,
+   gpointer user_data
+) {
+   if(
+      log_level &
+         (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING)
+   ) {
+      purple_debug_error( "voipms", "%s\n", message );
+   } else {
+      purple_debug_info( "voipms", "%s\n", message );
+   }
+}
+
+static gboolean voipms_load( PurplePlugin* plugin ) {
+   /* Route by number, kept up to date as things come and go, rather than *
+    * walking the account and conversation lists for every message.       */
+   _voipms_routes = g_hash_table_new_full(
+      g_str_hash, g_str_equal, g_free, voipms_route_free
+   );
+   purple_signal_connect(
+      purple_accounts_get_handle(), "account-signed-on", plugin,
+      PURPLE_CALLBACK( voipms_route_signed_on ), NULL
+   );
+   purple_signal_connect(
+      purple_accounts_get_handle(), "account-signed-off", plugin,
+      PURPLE_CALLBACK( voipms_route_signed_off ), NULL
+   );
+   purple_signal_connect(
+      purple_conversations_get_handle(), "conversation-created", plugin,
+      PURPLE_CALLBACK( voipms_route_conversation_created ), NULL
+   );
+   purple_signal_connect(
+      purple_conversations_get_handle(), "deleting-conversation", plugin,
+      PURPLE_CALLBACK( voipms_route_conversation_deleting ), NULL
+   );
+
+   /* Fetch history lazily, as conversations get opened. */
+   purple_signal_connect(
+      purple_conversations_get_handle(),
+      "conversation-created",
+      plugin,
+      PURPLE_CALLBACK( voipms_conversation_created ),
+      NULL
+   );
+
+   _voipms_log_handler = g_log_set_handler(
+      "voipms", G_LOG_LEVEL_MASK, voipms_log_handler, NULL
+   );
+
+   _voipms_bulk_cmd = purple_cmd_register(
+      "bulk", "ws", PURPLE_CMD_P_PRPL,
+      PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_PRPL_ONLY,
+      VOIPMS_PLUGIN_ID, voipms_bulk_cmd,
+      "bulk &lt;numbers or group&gt; &lt;message&gt;: Send a message to "
+         "several numbers (comma-separated) or a whole buddy group at once.",
+      NULL
+   );
+
+   return TRUE;
+}
+
+static gboolean voipms_unload( PurplePlugin* plugin ) {
+   purple_signals_disconnect_by_handle( plugin );
+   g_log_remove_handler( "voipms", _voipms_log_handler );
+   purple_cmd_unregister( _voipms_bulk_cmd );
+   g_hash_table_destroy( _voipms_routes );
+   _voipms_routes = NULL;
+
+   return TRUE;
+}
+
 static void voipms_destroy( PurplePlugin* plugin ) {
    purple_debug_info( "voipms", "Shutting down.\n" );
 }
@@ -29,26 +29,25 @@
 #  define PURPLE_PLUGINS
 #endif
 
-#define _GNU_SOURCE
-
 #include <stdarg.h>
-#include <string.h>
-#include <time.h>
-#include <glib.h>
-#include <curl/curl.h>
-#include <json-glib/json-glib.h>
+
+#include "voipms-core.h"
 
 #include "accountopt.h"
 #include "blist.h"
+#include "cmds.h"
 #include "core.h"
 #include "connection.h"
 #include "debug.h"
 #include "dnsquery.h"
+#include "imgstore.h"
+#include "log.h"
 #include "proxy.h"
 #include "prpl.h"
 #include "request.h"
 #include "savedstatuses.h"
 #include "sslconn.h"
+#include "util.h"
 #include "version.h"
 
 #if GLIB_MAJOR_VERSION >= 2 && GLIB_MINOR_VERSION >= 12
@@ -59,22 +58,23 @@
 #define VOIPMS_PLUGIN_VERSION "14.6.2"
 #define VOIPMS_PLUGIN_WEBSITE ""
 #define VOIPMS_PLUGIN_NAME "VOIP.ms SMS Protocol"
-#define VOIPMS_PLUGIN_DEFAULT_API_URL "https://voip.ms/api/v1/rest.php"
+#define VOIPMS_PLUGIN_DEFAULT_API_URL VOIPMS_API_URL
 
 #define VOIPMS_STATUS_ONLINE "available"
 #define VOIPMS_STATUS_AWAY "away"
 
-#define VOIPMS_ERROR_SIZE CURL_ERROR_SIZE + 255
-#define VOIPMS_DATE_BUFFER_SIZE 20
-#define VOIPMS_MAX_AGE_DAYS 91
-#define VOIPMS_DAY_SECONDS (60 * 60 * 24)
-#define VOIPMS_POLL_SECONDS 1
-
-typedef enum {
-   VOIPMS_METHOD_SENDSMS,
-   VOIPMS_METHOD_GETSMS,
-   VOIPMS_METHOD_DELETESMS
-} VOIPMS_METHOD;
+#define VOIPMS_HISTORY_DEFAULT_LIMIT 20
+#define VOIPMS_HISTORY_PAGE_DAYS 7
+#define VOIPMS_MMS_MAX_FILE_SIZE (20 * 1024 * 1024)
+#define VOIPMS_MMS_INLINE_MAX_SIZE (2 * 1024 * 1024)
+#define VOIPMS_REPLAY_TICK_MS 10
+#define VOIPMS_REPLAY_MAX_SPEED 100
+#define VOIPMS_TRACE_DUMP_SECONDS 300 /* Between dumps on error. */
+#define VOIPMS_FLOOD_DEFAULT_CONTACT 30 /* Messages a minute. */
+#define VOIPMS_FLOOD_DEFAULT_ACCOUNT 120
+#define VOIPMS_FLOOD_MAX_SUMMARIES 5 /* More contacts held get one notice. */
+#define VOIPMS_FLOOD_MAX_LISTED 20
+#define VOIPMS_FLOOD_HELD_IDLE_SECONDS 300 /* Then the held log is closed. */
 
 typedef void (*GcFunc)(
    PurpleConnection *from,
@@ -82,37 +82,81 @@ typedef void (*GcFunc)(
    gpointer userdata
 );
 
-struct RequestMemoryStruct {
-   char* memory;
-   size_t size;
+struct VoipMsReplay {
+   gchar* contents; /* The whole capture file. */
+   gsize length;
+   gsize offset; /* Next record to replay. */
+   guint speed;
+   guint timer;
+   gint64 started;
+   guint responses;
+   gint64 completion_total; /* Microseconds spent completing responses. */
+   gint64 completion_max;
 };
 
 struct VoipMsAccount {
    guint timer; 
-   CURLM* multi_handle;
-   int still_running;
-   gboolean requests_in_progress;
+   struct VoipMsSession* session;
+   GHashTable* history; /* Contact to struct VoipMsHistory. */
+   struct VoipMsReplay* replay; /* Polling is paused while this runs. */
+   struct VoipMsFlood* flood; /* NULL if incoming messages aren't limited. */
+   GHashTable* flood_held; /* Contact to struct VoipMsFloodHeld. */
+   gint64 flood_flushed; /* Monotonic seconds at the last summary check. */
+   gint64 trace_dumped; /* Monotonic seconds at the last dump on error. */
+   struct VoipMsSnapshot* snapshot; /* Saved on close, loaded on login. */
+   guint refresh_timer; /* The full buddy list walk, put off after login. */
 };
 
-struct VoipMsMessage {
+struct VoipMsMms {
    gchar* id;
    gchar* contact;
-   gchar* message;
-   struct tm timeinfo;
+   time_t time;
+   int pending; /* Downloads still running. */
+   gboolean failed;
+   gboolean relayed; /* The relay deletes it, not us. */
+   gboolean held; /* Over the flood limits; only log the attachments. */
    PurpleAccount* account;
 };
 
-struct VoipMsRequestData {
-   VOIPMS_METHOD method;
-   char* error_buffer;
-   struct RequestMemoryStruct chunk;
-   void* attachment;
+struct VoipMsMediaDownload {
+   struct VoipMsMms* mms;
+   FILE* file;
+   gchar* path;
+};
+
+/* Messages from one contact that went to the log instead of the screen, *
+ * waiting to be summed up.                                               */
+struct VoipMsFloodHeld {
+   gchar* contact;
+   guint count;
+   time_t last;
+   gint64 touched; /* Monotonic seconds at the last message held. */
+   PurpleLog* log; /* Kept open so they all land in the one log. */
+};
+
+struct VoipMsHistory {
+   gchar* contact;
+   GList* messages; /* Oldest first. */
+   GHashTable* ids; /* IDs of the messages above, to drop page overlaps. */
+   GList* fetched; /* Fetched but not yet shown in the conversation. */
+   gboolean fetching;
+   time_t page_to; /* End of the date window for the next page. */
 };
 
 struct VoipMsSendImData {
-   gboolean processed;
-   gboolean success; /* TRUE for send success, set by request monitor. */
-   gchar* error_buffer;
+   gchar* who; /* For reporting errors once the request is done. */
+};
+
+struct VoipMsBulkReport {
+   PurpleAccount* account;
+   gchar* conv_name; /* Where /bulk was typed; NULL from the menu. */
+   guint reported; /* Recipients finished at the last progress report. */
+};
+
+/* Everything we know by one number, across all of our accounts. */
+struct VoipMsRoute {
+   PurpleAccount* account; /* Signed on with this as its DID, if any. */
+   GSList* conversations; /* Open PurpleConversation* with this number. */
 };
 
 struct GcFuncData {
@@ -121,10 +165,5 @@ struct GcFuncData {
    gpointer userdata;
 };
 
-struct GcFuncDataMessageList {
-   GList* messages;
-   PurpleAccount* account;
-};
-
 #endif /* VOIPMS_H */
 